@@ -0,0 +1,443 @@
+#include "acl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "tenant.h"
+#include "debug.h"
+
+
+// Ethernet types
+#define ETH_VLAN	0x8100
+#define ETH_QINQ	0x88A8
+#define ETH_ARP		0x0806
+#define ETH_IPV4	0x0800
+#define ETH_IPV6	0x86DD
+
+// IP protocols
+#define IP_ICMP		1
+#define IP_TCP		6
+#define IP_UDP		17
+#define IP_ICMP6	58
+#define IP_SCTP		132
+
+// Words of frame key
+#define W_DST		0	// dst MAC << 16 | EtherType (inner one of tagged frame)
+#define W_SRC		1	// src MAC << 16 | 0x1000+VID of outer VLAN tag (0 - untagged)
+#define W_SRC_IP	2	// src IP, 2 words (IPv4 is ::ffff:a.b.c.d)
+#define W_DST_IP	4	// dst IP, 2 words
+#define W_L4		6	// protocol << 40 | sport << 24 | dport << 8 | KEY_* flags
+#define W_CONN		7	// direction << 32 | peer IP of connection (0 - local netif)
+#define KEY_WORDS	8
+
+// Flags of L4 word
+#define KEY_IP		0x01	// IP header is there
+#define KEY_PORTS	0x02	// and ports of TCP/UDP/SCTP
+
+// Port range becomes 30 prefixes at most
+#define MAX_PREFIXES	32
+
+
+// Rule with its ports ranges expanded: frame matches if every masked word of its key equals value
+struct acl_entry
+{
+    uint64_t value[KEY_WORDS], mask[KEY_WORDS];
+    bool drop;
+    int line;
+};
+
+struct acl_table
+{
+    struct acl_entry *entries;
+    int num;
+};
+
+struct acl_table *acl_tables=0;
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static inline uint64_t get32(const uint8_t *p)
+{
+    return ((uint64_t)get16(p) << 16) | get16(p+2);
+}
+
+
+static inline uint64_t get48(const uint8_t *p)
+{
+    return ((uint64_t)get16(p) << 32) | get32(p+2);
+}
+
+
+static inline uint64_t get64(const uint8_t *p)
+{
+    return (get32(p) << 32) | get32(p+4);
+}
+
+
+// Key of frame (fields which aren't in it are zeroes)
+static void make_key(uint64_t *k, uint32_t peer, uint8_t dir, const uint8_t *data, uint16_t len)
+{
+    memset(k, 0, sizeof(uint64_t)*KEY_WORDS);
+    k[W_CONN]=((uint64_t)dir << 32) | ntohl(peer);
+    if (len < 14) return;
+    
+    // VLAN tags (outer one is matched)
+    uint16_t type=get16(data+12);
+    uint16_t offs=14;
+    k[W_SRC]=get48(data+6) << 16;
+    if ( ((type == ETH_VLAN) || (type == ETH_QINQ)) && (len >= offs+4) )
+	k[W_SRC]|=0x1000 | (get16(data+offs) & 0x0fff);
+    while ( ((type == ETH_VLAN) || (type == ETH_QINQ)) && (len >= offs+4) )
+    {
+	type=get16(data+offs+2);
+	offs+=4;
+    }
+    k[W_DST]=(get48(data) << 16) | type;
+    
+    // IP header
+    const uint8_t *ip=data+offs;
+    uint8_t proto;
+    uint16_t l4;	// offset of L4 header (0 - ports aren't in this frame)
+    if ( (type == ETH_IPV4) && (len >= offs+20) )
+    {
+	k[W_SRC_IP+1]=0xffff00000000ULL | get32(ip+12);
+	k[W_DST_IP+1]=0xffff00000000ULL | get32(ip+16);
+	proto=ip[9];
+	uint16_t hl=(ip[0] & 0x0f)*4;
+	l4=( (hl >= 20) && ((get16(ip+6) & 0x1fff) == 0) ) ? offs+hl : 0;	// fragments after first have no ports
+    } else
+    if ( (type == ETH_IPV6) && (len >= offs+40) )
+    {
+	k[W_SRC_IP]=get64(ip+8);
+	k[W_SRC_IP+1]=get64(ip+16);
+	k[W_DST_IP]=get64(ip+24);
+	k[W_DST_IP+1]=get64(ip+32);
+	proto=ip[6];
+	l4=offs+40;
+	
+	// Skipping hop-by-hop, routing and destination options headers
+	while ( ((proto == 0) || (proto == 43) || (proto == 60)) && (len >= l4+8) )
+	{
+	    proto=data[l4];
+	    l4+=(data[l4+1]+1)*8;
+	}
+    } else
+	return;
+    
+    k[W_L4]=((uint64_t)proto << 40) | KEY_IP;
+    if ( (l4) && ((proto == IP_TCP) || (proto == IP_UDP) || (proto == IP_SCTP)) && (len >= l4+4) )
+	k[W_L4]|=((uint64_t)get16(data+l4) << 24) | ((uint64_t)get16(data+l4+2) << 8) | KEY_PORTS;
+}
+
+
+bool acl_check(uint16_t tenant, uint32_t peer, uint8_t dir, const uint8_t *data, uint16_t len)
+{
+    const struct acl_table *t=&acl_tables[tenant];
+    if (t->num == 0) return true;
+    
+    uint64_t k[KEY_WORDS];
+    make_key(k, peer, dir, data, len);
+    
+    for (const struct acl_entry *e=t->entries, *end=e+t->num; e<end; e++)
+    {
+	uint64_t x=0;
+	for (int w=0; w<KEY_WORDS; w++)
+	    x|=(k[w] & e->mask[w]) ^ e->value[w];
+	if (x == 0)
+	{
+	    if (e->drop) DEBUG("ACL: dropped by rule at line %d\n", e->line);
+	    return ! e->drop;
+	}
+    }
+    return true;
+}
+
+
+// Rule being parsed (tenant -1 - every tenant)
+struct rule
+{
+    struct acl_entry e;
+    int tenant;
+    uint32_t sport[MAX_PREFIXES], dport[MAX_PREFIXES];	// value << 16 | mask
+    int sports, dports;
+};
+
+
+// Adding match to rule (false if it contradicts one rule has already)
+static bool match(struct acl_entry *e, int w, uint64_t value, uint64_t mask)
+{
+    value&=mask;
+    if ( (e->value[w] ^ value) & e->mask[w] & mask ) return false;
+    e->value[w]|=value;
+    e->mask[w]|=mask;
+    return true;
+}
+
+
+static uint64_t bits_mask(int bits)
+{
+    return (bits <= 0) ? 0 : (bits >= 64) ? ~0ULL : ~0ULL << (64-bits);
+}
+
+
+// Prefixes covering range of ports
+static int port_prefixes(const char *str, uint32_t *p)
+{
+    char *end;
+    long lo=strtol(str, &end, 10), hi=lo;
+    if (*end == '-') hi=strtol(end+1, &end, 10);
+    if ( (end == str) || (*end) || (lo < 0) || (hi > 65535) || (lo > hi) ) return 0;
+    
+    // Largest aligned block starting at lo each time
+    int n=0;
+    while (lo <= hi)
+    {
+	long size=1;
+	while ( (size < 65536) && ((lo & (size*2-1)) == 0) && (lo+size*2-1 <= hi) )
+	    size*=2;
+	p[n++]=(lo << 16) | (uint16_t)~(size-1);
+	lo+=size;
+    }
+    return n;
+}
+
+
+// IP[/LEN] to words of key
+static bool parse_prefix(struct acl_entry *e, int w, const char *str)
+{
+    char ip[64];
+    int bits=-1;
+    uint8_t a[16];
+    if (sscanf(str, "%63[0-9a-fA-F.:]/%d", ip, &bits) < 1) return false;
+    
+    if (inet_pton(AF_INET, ip, a) == 1)
+    {
+	if (bits < 0) bits=32;
+	if (bits > 32) return false;
+	return (match(e, W_DST, ETH_IPV4, 0xffff)) &&
+	       (match(e, w, 0, ~0ULL)) &&
+	       (match(e, w+1, 0xffff00000000ULL | get32(a), 0xffffffff00000000ULL | (bits_mask(bits) >> 32)));
+    }
+    if (inet_pton(AF_INET6, ip, a) == 1)
+    {
+	if (bits < 0) bits=128;
+	if (bits > 128) return false;
+	return (match(e, W_DST, ETH_IPV6, 0xffff)) &&
+	       (match(e, w, get64(a), bits_mask(bits))) &&
+	       (match(e, w+1, get64(a+8), bits_mask(bits-64)));
+    }
+    return false;
+}
+
+
+static bool parse_mac(struct acl_entry *e, int w, const char *str)
+{
+    unsigned int m[6];
+    char c;
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c", m+0, m+1, m+2, m+3, m+4, m+5, &c) != 6) return false;
+    
+    uint64_t v=0;
+    for (int i=0; i<6; i++)
+    {
+	if (m[i] > 255) return false;
+	v=(v << 8) | m[i];
+    }
+    return match(e, w, v << 16, 0xffffffffffffULL << 16);
+}
+
+
+static long parse_num(const char *str, long max)
+{
+    char *end;
+    long n=strtol(str, &end, 0);
+    return ( (end == str) || (*end) || (n < 0) || (n > max) ) ? -1 : n;
+}
+
+
+// Parsing words of rule (error message if it's wrong)
+static const char* parse_rule(char *s, struct rule *r)
+{
+    char *save;
+    char *word=strtok_r(s, " \t\r\n", &save);
+    
+    memset(r, 0, sizeof(*r));
+    r->tenant=-1;
+    if (strcmp(word, "drop") == 0) r->e.drop=true; else
+    if (strcmp(word, "pass") != 0) return "rule must start with drop or pass";
+    
+    while ( (word=strtok_r(0, " \t\r\n", &save)) )
+    {
+	struct acl_entry *e=&r->e;
+	
+	// Directions take no value
+	if (strcmp(word, "in") == 0)
+	{
+	    if (! match(e, W_CONN, (uint64_t)ACL_IN << 32, 0xffULL << 32)) return "contradicting direction";
+	    continue;
+	}
+	if (strcmp(word, "out") == 0)
+	{
+	    if (! match(e, W_CONN, (uint64_t)ACL_OUT << 32, 0xffULL << 32)) return "contradicting direction";
+	    continue;
+	}
+	
+	char *v=strtok_r(0, " \t\r\n", &save);
+	if (! v) return "missing value";
+	
+	if (strcmp(word, "tenant") == 0)
+	{
+	    r->tenant=parse_num(v, tenants_num-1);
+	    if (r->tenant < 0) return "no such tenant";
+	} else
+	if (strcmp(word, "peer") == 0)
+	{
+	    // Only frames from connections have peer
+	    char ip[32];
+	    int bits=32;
+	    struct in_addr a;
+	    if ( (sscanf(v, "%31[0-9.]/%d", ip, &bits) < 1) || (inet_pton(AF_INET, ip, &a) != 1) ||
+		 (bits < 0) || (bits > 32) ||
+		 (! match(e, W_CONN, ((uint64_t)ACL_IN << 32) | ntohl(a.s_addr), (0xffULL << 32) | (bits_mask(bits) >> 32))) )
+		return "incorrect peer (IP[/LEN] of connections from tunnel)";
+	} else
+	if ( (strcmp(word, "src-mac") == 0) || (strcmp(word, "dst-mac") == 0) )
+	{
+	    if (! parse_mac(e, (word[0] == 's') ? W_SRC : W_DST, v)) return "incorrect MAC";
+	} else
+	if (strcmp(word, "type") == 0)
+	{
+	    long t=(strcmp(v, "arp") == 0) ? ETH_ARP :
+		   (strcmp(v, "ipv4") == 0) ? ETH_IPV4 :
+		   (strcmp(v, "ipv6") == 0) ? ETH_IPV6 : parse_num(v, 0xffff);
+	    if ( (t < 0) || (! match(e, W_DST, t, 0xffff)) ) return "incorrect type";
+	} else
+	if (strcmp(word, "vlan") == 0)
+	{
+	    long id=parse_num(v, 4095);
+	    if ( (id < 0) || (! match(e, W_SRC, 0x1000 | id, 0x1fff)) ) return "incorrect VLAN";
+	} else
+	if ( (strcmp(word, "src") == 0) || (strcmp(word, "dst") == 0) )
+	{
+	    if (! parse_prefix(e, (word[0] == 's') ? W_SRC_IP : W_DST_IP, v)) return "incorrect IP prefix";
+	} else
+	if (strcmp(word, "proto") == 0)
+	{
+	    long p=(strcmp(v, "icmp") == 0) ? IP_ICMP :
+		   (strcmp(v, "tcp") == 0) ? IP_TCP :
+		   (strcmp(v, "udp") == 0) ? IP_UDP :
+		   (strcmp(v, "icmp6") == 0) ? IP_ICMP6 :
+		   (strcmp(v, "sctp") == 0) ? IP_SCTP : parse_num(v, 255);
+	    if ( (p < 0) || (! match(e, W_L4, ((uint64_t)p << 40) | KEY_IP, (0xffULL << 40) | KEY_IP)) ) return "incorrect protocol";
+	} else
+	if (strcmp(word, "sport") == 0)
+	{
+	    r->sports=port_prefixes(v, r->sport);
+	    if (r->sports == 0) return "incorrect port range";
+	} else
+	if (strcmp(word, "dport") == 0)
+	{
+	    r->dports=port_prefixes(v, r->dport);
+	    if (r->dports == 0) return "incorrect port range";
+	} else
+	    return "unknown match";
+    }
+    
+    // Ports are in frames of TCP/UDP/SCTP only
+    if ( (r->sports) || (r->dports) ) match(&r->e, W_L4, KEY_PORTS | KEY_IP, KEY_PORTS | KEY_IP);
+    return 0;
+}
+
+
+bool acl_load(const char *file)
+{
+    FILE *f=fopen(file, "r");
+    if (! f)
+    {
+	perror(file);
+	return false;
+    }
+    
+    // Rules of file with their ports expanded (in order)
+    struct acl_entry *all=0;
+    int *owner=0;	// tenant of entry (-1 - every one)
+    int num=0, max=0, rules=0;
+    
+    char s[1024];
+    struct rule r;
+    for (int line=1; fgets(s, sizeof(s), f); line++)
+    {
+	char *c=strchr(s, '#');
+	if (c) (*c)=0;
+	if (strspn(s, " \t\r\n") == strlen(s)) continue;	// nothing but comment
+	
+	const char *err=parse_rule(s, &r);
+	if (err)
+	{
+	    fprintf(stderr, "Error: %s:%d: %s\n", file, line, err);
+	    fclose(f);
+	    delete[] all;
+	    delete[] owner;
+	    return false;
+	}
+	r.e.line=line;
+	rules++;
+	
+	// One entry for every pair of sport and dport prefixes
+	int sn=(r.sports) ? r.sports : 1, dn=(r.dports) ? r.dports : 1;
+	if (num+sn*dn > max)
+	{
+	    max=(num+sn*dn)*2;
+	    struct acl_entry *a=new struct acl_entry[max];
+	    int *o=new int[max];
+	    if (all)
+	    {
+		memcpy(a, all, sizeof(struct acl_entry)*num);
+		memcpy(o, owner, sizeof(int)*num);
+		delete[] all;
+		delete[] owner;
+	    }
+	    all=a;
+	    owner=o;
+	}
+	for (int i=0; i<sn; i++)
+	    for (int j=0; j<dn; j++)
+	    {
+		struct acl_entry *e=&all[num];
+		(*e)=r.e;
+		if (r.sports) match(e, W_L4, (uint64_t)(r.sport[i] >> 16) << 24, (uint64_t)(r.sport[i] & 0xffff) << 24);
+		if (r.dports) match(e, W_L4, (uint64_t)(r.dport[j] >> 16) << 8, (uint64_t)(r.dport[j] & 0xffff) << 8);
+		owner[num++]=r.tenant;
+	    }
+    }
+    fclose(f);
+    
+    // Flat table of every tenant: rules for any tenant and its own ones
+    if (num > 0)
+    {
+	acl_tables=new struct acl_table[tenants_num];
+	for (int t=0; t<tenants_num; t++)
+	{
+	    struct acl_table *tab=&acl_tables[t];
+	    tab->num=0;
+	    for (int i=0; i<num; i++)
+		if ( (owner[i] < 0) || (owner[i] == t) ) tab->num++;
+	    
+	    tab->entries=(tab->num > 0) ? new struct acl_entry[tab->num] : 0;
+	    int n=0;
+	    for (int i=0; i<num; i++)
+		if ( (owner[i] < 0) || (owner[i] == t) ) tab->entries[n++]=all[i];
+	}
+    }
+    delete[] all;
+    delete[] owner;
+    
+    DEBUG("ACL: %d rules, %d entries\n", rules, num);
+    return true;
+}
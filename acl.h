@@ -0,0 +1,34 @@
+#ifndef ACL_H
+#define ACL_H
+
+
+#include <stdint.h>
+
+
+// ACL directions
+#define ACL_IN	1	// frame received from tunnel
+#define ACL_OUT	2	// frame read from local netif
+
+
+// Rules of tenant flattened into one array (see acl.cpp)
+struct acl_table;
+
+// Table of every tenant (0 - no rules loaded)
+extern struct acl_table *acl_tables;
+
+
+// Loading and compiling rules file (tenants must be known already)
+bool acl_load(const char *file);
+
+// First matching rule of tenant decides (frame passes if none matches)
+bool acl_check(uint16_t tenant, uint32_t peer, uint8_t dir, const uint8_t *data, uint16_t len);
+
+
+// Checking frame if there are rules (it's just one check if not)
+static inline bool acl_pass(uint16_t tenant, uint32_t peer, uint8_t dir, const uint8_t *data, uint16_t len)
+{
+    return (__builtin_expect(acl_tables == 0, 1)) || (acl_check(tenant, peer, dir, data, len));
+}
+
+
+#endif
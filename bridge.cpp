@@ -0,0 +1,289 @@
+#include "bridge.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "csum.h"
+#include "debug.h"
+
+
+// RX ring: blocks of frames, block is given to us when it's full or after timeout
+#define RX_BLOCK_SIZE	(1 << 18)
+#define RX_BLOCKS	16
+#define RX_TIMEOUT	2	// ms
+
+// TX ring: fixed size frames
+#define TX_FRAME_SIZE	2048
+#define TX_FRAMES	512
+
+// Linux 4.20+ (older kernels give us outgoing frames, they're skipped by type)
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING	23
+#endif
+
+
+int bridge_fd=-1;
+
+static uint8_t *rx_ring=0;
+static uint32_t rx_block=0;
+static uint8_t *tx_ring=0;
+static uint32_t tx_frame=0;
+static uint32_t tx_pending=0;
+
+
+// Frames sent by local stack may have only pseudo-header checksum (offloaded to hardware)
+static void fix_csum(uint8_t *data, uint16_t len)
+{
+    uint16_t offs=12;
+    if ( (len >= 18) && (data[12] == 0x81) && (data[13] == 0x00) ) offs+=4;	// VLAN
+    if (len < offs+2) return;
+    
+    uint16_t type=(data[offs] << 8) | data[offs+1];
+    uint8_t *ip=data+offs+2;
+    uint16_t iplen=len-offs-2;
+    uint8_t proto;
+    uint8_t *l4;
+    uint16_t l4len;
+    uint32_t sum;
+    
+    if ( (type == 0x0800) && (iplen >= 20) )
+    {
+	uint16_t hl=(ip[0] & 15)*4;
+	uint16_t tl=(ip[2] << 8) | ip[3];
+	if ( (hl < 20) || (tl < hl) || (tl > iplen) ) return;
+	proto=ip[9];
+	l4=ip+hl;
+	l4len=tl-hl;
+	sum=csum_add(0, ip+12, 8);
+    } else
+    if ( (type == 0x86DD) && (iplen >= 40) )
+    {
+	uint16_t pl=(ip[4] << 8) | ip[5];
+	if (pl > iplen-40) return;
+	proto=ip[6];
+	l4=ip+40;
+	l4len=pl;
+	sum=csum_add(0, ip+8, 32);
+    } else
+	return;
+    
+    uint8_t *c;
+    if ( (proto == 6) && (l4len >= 20) )
+	c=l4+16; else	// TCP
+    if ( (proto == 17) && (l4len >= 8) )
+	c=l4+6; else	// UDP
+	return;
+    
+    c[0]=0;
+    c[1]=0;
+    sum+=proto + l4len;
+    sum=~csum_add(sum, l4, l4len) & 0xffff;
+    if ( (proto == 17) && (sum == 0) ) sum=0xffff;
+    c[0]=sum >> 8;
+    c[1]=sum & 0xff;
+}
+
+
+const char* bridge_open(const char *ifname)
+{
+    if ( (bridge_fd=socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0 )
+    {
+	perror("socket(AF_PACKET)");
+	return 0;
+    }
+    
+    int ver=TPACKET_V3;
+    if (setsockopt(bridge_fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+    {
+	perror("PACKET_VERSION");
+	goto fail;
+    }
+    
+    // Rings
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size=RX_BLOCK_SIZE;
+    req.tp_block_nr=RX_BLOCKS;
+    req.tp_frame_size=TX_FRAME_SIZE;
+    req.tp_frame_nr=(RX_BLOCK_SIZE / TX_FRAME_SIZE) * RX_BLOCKS;
+    req.tp_retire_blk_tov=RX_TIMEOUT;
+    if (setsockopt(bridge_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+	perror("PACKET_RX_RING");
+	goto fail;
+    }
+    
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size=RX_BLOCK_SIZE;
+    req.tp_block_nr=(TX_FRAME_SIZE * TX_FRAMES) / RX_BLOCK_SIZE;
+    req.tp_frame_size=TX_FRAME_SIZE;
+    req.tp_frame_nr=TX_FRAMES;
+    if (setsockopt(bridge_fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+    {
+	perror("PACKET_TX_RING");
+	goto fail;
+    }
+    
+    {
+	size_t rx_size=RX_BLOCK_SIZE * RX_BLOCKS;
+	size_t tx_size=TX_FRAME_SIZE * TX_FRAMES;
+	void *m=mmap(0, rx_size + tx_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, bridge_fd, 0);
+	if (m == MAP_FAILED)
+	    m=mmap(0, rx_size + tx_size, PROT_READ | PROT_WRITE, MAP_SHARED, bridge_fd, 0);
+	if (m == MAP_FAILED)
+	{
+	    perror("mmap");
+	    goto fail;
+	}
+	rx_ring=(uint8_t*)m;
+	tx_ring=rx_ring + rx_size;
+    }
+    
+    // Binding to interface
+    {
+	struct sockaddr_ll ll;
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family=AF_PACKET;
+	ll.sll_protocol=htons(ETH_P_ALL);
+	ll.sll_ifindex=if_nametoindex(ifname);
+	if (ll.sll_ifindex == 0)
+	{
+	    fprintf(stderr, "Error: no interface %s\n", ifname);
+	    goto fail;
+	}
+	if (bind(bridge_fd, (struct sockaddr*)&ll, sizeof(ll)) < 0)
+	{
+	    perror("bind");
+	    goto fail;
+	}
+	
+	// Getting frames for all MACs behind tunnel
+	struct packet_mreq mr;
+	memset(&mr, 0, sizeof(mr));
+	mr.mr_ifindex=ll.sll_ifindex;
+	mr.mr_type=PACKET_MR_PROMISC;
+	if (setsockopt(bridge_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0)
+	{
+	    perror("PACKET_ADD_MEMBERSHIP");
+	    goto fail;
+	}
+	
+	// Frames sent out of interface by this host go to the wire, not back to tunnel
+	int on=1;
+	setsockopt(bridge_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+    }
+    
+    return ifname;
+
+fail:
+    close(bridge_fd);
+    bridge_fd=-1;
+    return 0;
+}
+
+
+void bridge_read(frameHandler handler)
+{
+    while (1)
+    {
+	struct tpacket_block_desc *bd=(struct tpacket_block_desc*)(rx_ring + rx_block*RX_BLOCK_SIZE);
+	if (! (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) return;
+	
+	// Walking frames of block
+	struct tpacket3_hdr *h=(struct tpacket3_hdr*)((uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt);
+	for (uint32_t i=0; i<bd->hdr.bh1.num_pkts; i++)
+	{
+	    uint8_t *data=(uint8_t*)h + h->tp_mac;
+	    uint16_t len=h->tp_snaplen;
+	    const struct sockaddr_ll *ll=(const struct sockaddr_ll*)((uint8_t*)h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+	    
+	    if (ll->sll_pkttype == PACKET_OUTGOING)
+	    {
+		// Sent by this host (kernel doesn't know PACKET_IGNORE_OUTGOING)
+		len=0;
+	    } else
+	    if (h->tp_len != h->tp_snaplen)
+	    {
+		// Too long (GRO/TSO is enabled on interface?)
+		DEBUG("Bridge: dropping truncated frame %d\n", h->tp_len);
+		len=0;
+	    } else
+	    if (h->tp_status & TP_STATUS_CSUMNOTREADY)
+		fix_csum(data, len);
+	    
+	    if ( (h->tp_status & TP_STATUS_VLAN_VALID) && (len >= 14) && (len <= 1596) )
+	    {
+		// Putting back VLAN tag stripped by driver
+		uint8_t buf[1600];
+		memcpy(buf, data, 12);
+		buf[12]=0x81;
+		buf[13]=0x00;
+		buf[14]=h->hv1.tp_vlan_tci >> 8;
+		buf[15]=h->hv1.tp_vlan_tci & 0xff;
+		memcpy(buf+16, data+12, len-12);
+		handler(buf, len+4);
+	    } else
+	    if (len >= 14)
+		handler(data, len);
+	    
+	    h=(struct tpacket3_hdr*)((uint8_t*)h + h->tp_next_offset);
+	}
+	
+	// Giving block back to kernel
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	if (++rx_block >= RX_BLOCKS) rx_block=0;
+    }
+}
+
+
+bool bridge_write(const uint8_t *data, uint16_t len)
+{
+    struct tpacket3_hdr *h=(struct tpacket3_hdr*)(tx_ring + tx_frame*TX_FRAME_SIZE);
+    uint32_t status=__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE);
+    
+    if (status == TP_STATUS_WRONG_FORMAT)
+    {
+	DEBUG("Bridge: frame rejected by kernel\n");
+    } else
+    if (status != TP_STATUS_AVAILABLE)
+    {
+	// Ring is full - trying to push it
+	bridge_flush();
+	DEBUG("Bridge: TX ring is full\n");
+	return false;
+    }
+    
+    uint8_t *buf=(uint8_t*)h + TPACKET3_HDRLEN - sizeof(struct sockaddr_ll);
+    if (len > TX_FRAME_SIZE - (buf - (uint8_t*)h)) return false;
+    memcpy(buf, data, len);
+    h->tp_len=len;
+    h->tp_next_offset=0;
+    __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    
+    if (++tx_frame >= TX_FRAMES) tx_frame=0;
+    tx_pending++;
+    return true;
+}
+
+
+void bridge_flush()
+{
+    if (! tx_pending) return;
+    
+    // One syscall for all frames put to ring since last flush
+    if ( (send(bridge_fd, 0, 0, MSG_DONTWAIT) < 0) && (errno != EAGAIN) && (errno != ENOBUFS) )
+    {
+	DEBUG("Bridge: send failed (errno=%d)\n", errno);
+    }
+    tx_pending=0;
+}
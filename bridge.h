@@ -0,0 +1,27 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+
+#include <stdint.h>
+
+
+typedef void (*frameHandler)(const uint8_t *data, uint16_t len);
+
+
+extern int bridge_fd;
+
+
+// Attach to existing interface with memory-mapped RX/TX rings
+const char* bridge_open(const char *ifname);
+
+// Pass all received frames to handler
+void bridge_read(frameHandler handler);
+
+// Put frame to TX ring (it's sent by bridge_flush)
+bool bridge_write(const uint8_t *data, uint16_t len);
+
+// Ask kernel to send frames from TX ring
+void bridge_flush();
+
+
+#endif
@@ -0,0 +1,89 @@
+#include "bucket.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+// Bucket depth is rate of this time (but enough for a few full frames)
+#define BURST_MS	100
+#define BURST_MIN_BYTES	8192
+#define BURST_MIN_FRAMES 4
+
+// Refilling more often only loses rounded-off bytes
+#define REFILL_MS	10
+
+
+struct rate rate_in={ 0, 0 };
+struct rate rate_out={ 0, 0 };
+
+
+bool rate_parse(struct rate *r, const char *str)
+{
+    char *end;
+    unsigned long bytes=strtoul(str, &end, 10);
+    unsigned long frames=0;
+    
+    if ( (*end == 'k') || (*end == 'K') )
+    {
+	bytes*=1000;
+	end++;
+    } else if ( (*end == 'm') || (*end == 'M') )
+    {
+	bytes*=1000000;
+	end++;
+    }
+    if ( (end != str) && (*end == ',') )
+    {
+	str=end+1;
+	frames=strtoul(str, &end, 10);
+    }
+    
+    if ( (end == str) || (*end != 0) || (bytes > 0x7fffffff) || (frames > 1000000) )
+    {
+	fprintf(stderr, "Error: incorrect rate\n");
+	return false;
+    }
+    r->bytes=bytes;
+    r->frames=frames;
+    return true;
+}
+
+
+uint32_t bucket_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+static inline int32_t refill(int32_t tokens, uint32_t rate, uint32_t ms, int32_t depth)
+{
+    int64_t t=tokens + (int64_t)rate*ms/1000;
+    return (t > depth) ? depth : t;
+}
+
+
+bool bucket_ok(struct bucket *b, const struct rate *r, uint32_t now)
+{
+    int32_t depth_bytes=(int64_t)r->bytes*BURST_MS/1000, depth_frames=r->frames*BURST_MS;
+    if (depth_bytes < BURST_MIN_BYTES) depth_bytes=BURST_MIN_BYTES;
+    if (depth_frames < BURST_MIN_FRAMES*1000) depth_frames=BURST_MIN_FRAMES*1000;
+    
+    if (b->t == 0)
+    {
+	// New bucket is full
+	b->bytes=depth_bytes;
+	b->frames=depth_frames;
+	b->t=now;
+    } else if (now - b->t >= REFILL_MS)
+    {
+	uint32_t ms=now - b->t;
+	if (r->bytes) b->bytes=refill(b->bytes, r->bytes, ms, depth_bytes);
+	if (r->frames) b->frames=refill(b->frames, r->frames*1000, ms, depth_frames);
+	b->t=now;
+    }
+    
+    return ( (! r->bytes) || (b->bytes > 0) ) && ( (! r->frames) || (b->frames > 0) );
+}
@@ -0,0 +1,49 @@
+#ifndef BUCKET_H
+#define BUCKET_H
+
+
+#include <stdint.h>
+
+
+// Rate per second (0 - unlimited)
+struct rate
+{
+    uint32_t bytes;
+    uint32_t frames;
+};
+
+// Token bucket (goes negative when single read/write takes more than it has)
+struct bucket
+{
+    int32_t bytes;
+    int32_t frames;	// in 1/1000 of frame (so slow rates are refilled in small steps too)
+    uint32_t t;	// last refill in ms (0 - never)
+};
+
+
+// Limits of every client connection (server only)
+extern struct rate rate_in, rate_out;
+
+
+// Parsing "BYTES[k|m][,FRAMES]"
+bool rate_parse(struct rate *r, const char *str);
+
+static inline bool rate_set(const struct rate *r)
+{
+    return (r->bytes) || (r->frames);
+}
+
+// Monotonic time in ms
+uint32_t bucket_now();
+
+// Refilling bucket, checking it has tokens
+bool bucket_ok(struct bucket *b, const struct rate *r, uint32_t now);
+
+static inline void bucket_take(struct bucket *b, uint32_t bytes, uint32_t frames)
+{
+    b->bytes-=bytes;
+    b->frames-=frames*1000;
+}
+
+
+#endif
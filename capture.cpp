@@ -0,0 +1,246 @@
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "debug.h"
+
+
+// pcapng block types
+#define PCAPNG_SHB	0x0A0D0D0A	// section header
+#define PCAPNG_IDB	0x00000001	// interface description
+#define PCAPNG_NRB	0x00000004	// name resolution (used as empty slot)
+#define PCAPNG_EPB	0x00000006	// enhanced packet
+
+// pcapng option codes
+#define OPT_ENDOFOPT	0
+#define OPT_COMMENT	1
+#define OPT_EPB_FLAGS	2
+
+// Bytes reserved in every slot for comment (peer address)
+#define SLOT_COMMENT	32
+
+// Slot overhead: EPB header(28) + flags option(8) + comment header(4) + end of options(4) + trailer(4)
+#define SLOT_HDR	48
+
+// File header: SHB(28) + IDB(20)
+#define FILE_HDR	48
+
+
+#define PAD4(x)		(((x)+3) & ~3)
+
+
+volatile int capture_on=0;
+
+static uint8_t *ring=0;		// mapped file
+static uint32_t slot_size;
+static uint32_t slot_count;
+static uint32_t slot_next;
+static uint16_t snap_len;
+
+// Filters
+static bool filter_mac=false;
+static uint8_t filter_mac_addr[6];
+static bool filter_peer=false;
+static uint32_t filter_peer_addr;
+static uint16_t filter_peer_port;
+
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    memcpy(p, &v, 2);
+}
+
+
+// Empty slot is a name resolution block without records, padded by comment
+static void empty_slot(uint8_t *p)
+{
+    memset(p, 0, slot_size);
+    put32(p+0, PCAPNG_NRB);
+    put32(p+4, slot_size);
+    // p+8: nrb_record_end
+    put16(p+12, OPT_COMMENT);
+    put16(p+14, slot_size-24);
+    // comment, then opt_endofopt
+    put32(p+slot_size-4, slot_size);
+}
+
+
+static void toggle(int sig)
+{
+    capture_on=!capture_on;
+}
+
+
+bool capture_open(const char *file, int size_kb, int snaplen)
+{
+    if ( (snaplen < 14) || (snaplen > 1600) )
+    {
+	fprintf(stderr, "Error: incorrect capture snaplen\n");
+	return false;
+    }
+    
+    snap_len=snaplen;
+    slot_size=SLOT_HDR + PAD4(snaplen) + SLOT_COMMENT;
+    slot_count=((uint64_t)size_kb*1024 - FILE_HDR) / slot_size;
+    if ( (size_kb <= 0) || (slot_count < 16) )
+    {
+	fprintf(stderr, "Error: capture ring is too small\n");
+	return false;
+    }
+    size_t size=FILE_HDR + (size_t)slot_count*slot_size;
+    
+    // Preallocating file
+    int fd=open(file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+	perror(file);
+	return false;
+    }
+    if (posix_fallocate(fd, 0, size) != 0)
+    {
+	fprintf(stderr, "Error: can't allocate capture file\n");
+	close(fd);
+	return false;
+    }
+    
+    // Mapping it
+    void *m=mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+	perror("mmap");
+	return false;
+    }
+    ring=(uint8_t*)m;
+    
+    // Section header
+    put32(ring+0, PCAPNG_SHB);
+    put32(ring+4, 28);
+    put32(ring+8, 0x1A2B3C4D);	// byte-order magic
+    put16(ring+12, 1);		// version 1.0
+    put16(ring+14, 0);
+    memset(ring+16, 0xff, 8);	// section length is unknown
+    put32(ring+24, 28);
+    
+    // Interface (ethernet)
+    put32(ring+28, PCAPNG_IDB);
+    put32(ring+32, 20);
+    put16(ring+36, 1);		// LINKTYPE_ETHERNET
+    put16(ring+38, 0);
+    put32(ring+40, snap_len);
+    put32(ring+44, 20);
+    
+    // Empty slots
+    for (uint32_t i=0; i<slot_count; i++)
+	empty_slot(ring + FILE_HDR + i*slot_size);
+    slot_next=0;
+    
+    // SIGUSR1 starts/stops capture
+    signal(SIGUSR1, toggle);
+    
+    return true;
+}
+
+
+bool capture_filter_mac(const char *mac_str)
+{
+    unsigned int m[6];
+    if (sscanf(mac_str, "%x:%x:%x:%x:%x:%x", m+0, m+1, m+2, m+3, m+4, m+5) != 6)
+    {
+	fprintf(stderr, "Error: incorrect capture MAC\n");
+	return false;
+    }
+    for (uint8_t i=0; i<6; i++)
+	filter_mac_addr[i]=m[i];
+    filter_mac=true;
+    return true;
+}
+
+
+bool capture_filter_peer(const char *addr_str)
+{
+    char ip[32];
+    int port=0;
+    
+    if ( (sscanf(addr_str, "%31[0-9.]:%d", ip, &port) < 1) ||
+	 (inet_pton(AF_INET, ip, &filter_peer_addr) != 1) ||
+	 (port < 0) || (port > 65535) )
+    {
+	fprintf(stderr, "Error: incorrect capture peer\n");
+	return false;
+    }
+    filter_peer_port=htons(port);
+    filter_peer=true;
+    return true;
+}
+
+
+void capture_pkt(Conn *c, const uint8_t *data, uint16_t len, uint8_t dir)
+{
+    if (! ring) return;
+    
+    // Filtering
+    if ( (filter_mac) &&
+	 (memcmp(data+0, filter_mac_addr, 6) != 0) &&
+	 (memcmp(data+6, filter_mac_addr, 6) != 0) )
+	return;
+    if ( (filter_peer) &&
+	 ( (! c) || (c->addr != filter_peer_addr) ||
+	   ((filter_peer_port) && (c->port != filter_peer_port)) ) )
+	return;
+    
+    // Taking next slot
+    uint8_t *p=ring + FILE_HDR + slot_next*slot_size;
+    if (++slot_next >= slot_count) slot_next=0;
+    
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    uint64_t ts=(uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+    uint16_t caplen=(len > snap_len) ? snap_len : len;
+    
+    // Enhanced packet block
+    put32(p+0, PCAPNG_EPB);
+    put32(p+4, slot_size);
+    put32(p+8, 0);		// interface id
+    put32(p+12, ts >> 32);
+    put32(p+16, ts & 0xffffffff);
+    put32(p+20, caplen);
+    put32(p+24, len);
+    memcpy(p+28, data, caplen);
+    uint8_t *o=p+28+PAD4(caplen);
+    memset(o-(PAD4(caplen)-caplen), 0, PAD4(caplen)-caplen);
+    
+    // Direction
+    put16(o+0, OPT_EPB_FLAGS);
+    put16(o+2, 4);
+    put32(o+4, dir);
+    
+    // Comment with peer address, padded up to the end of slot
+    uint16_t clen=slot_size - SLOT_HDR - PAD4(caplen);
+    put16(o+8, OPT_COMMENT);
+    put16(o+10, clen);
+    memset(o+12, 0, clen);
+    if (c)
+    {
+	const uint8_t *a=(const uint8_t*)&c->addr;
+	snprintf((char*)o+12, SLOT_COMMENT, "peer %d.%d.%d.%d:%d", a[0], a[1], a[2], a[3], ntohs(c->port));
+    } else
+	strcpy((char*)o+12, "local");
+    put32(o+12+clen, OPT_ENDOFOPT);
+    put32(p+slot_size-4, slot_size);
+}
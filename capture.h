@@ -0,0 +1,40 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+
+#include <stdint.h>
+
+
+class Conn;
+
+
+// Capture directions
+#define CAPTURE_IN	1	// frame received from tunnel
+#define CAPTURE_OUT	2	// frame read from local netif
+
+
+// Non-zero while capture is running (toggled by SIGUSR1)
+extern volatile int capture_on;
+
+
+// Create preallocated memory-mapped pcapng ring file
+bool capture_open(const char *file, int size_kb, int snaplen);
+
+// Capture only frames with specified src or dst MAC
+bool capture_filter_mac(const char *mac_str);
+
+// Capture only frames of connection with specified peer IP[:PORT]
+bool capture_filter_peer(const char *addr_str);
+
+// Put frame to the ring
+void capture_pkt(Conn *c, const uint8_t *data, uint16_t len, uint8_t dir);
+
+
+// Capture frame if capture is running (it's just one check if not)
+static inline void capture(Conn *c, const uint8_t *data, uint16_t len, uint8_t dir)
+{
+    if (__builtin_expect(capture_on, 0)) capture_pkt(c, data, len, dir);
+}
+
+
+#endif
@@ -21,39 +21,66 @@
 
 #include "conn.h"
 #include "tap.h"
+#include "capture.h"
+#include "acl.h"
+#include "latency.h"
+#include "mss.h"
+#include "pool.h"
+#include "shortcut.h"
+#include "cycles.h"
+#include "probe.h"
 #include "debug.h"
 
 
 #define MAX_PACKET_SIZE	(1536+4)
 
 
+// Session given by server (to resume it after reconnect)
+static uint8_t session[16];
+static bool has_session=false;
+
+
 bool writeTap(Conn *src, const uint8_t *data, uint16_t size)
 {
-    uint8_t buf[size+4];
-    
-    // Adding TAP header
-    buf[0]=0;
-    buf[1]=0;
-    buf[2]=data[12];	// protocol type
-    buf[3]=data[13];
-    memcpy(buf+4, data, size);
-    
-    // Sending
-    if (write(tap_fd, buf, size+4) != size+4)
+    // Received frame's buffer has room for TAP header
+    return tap_write_buf(src->rd.buf+POOL_DATA-4, size);
+}
+
+
+static bool control(Conn *src, uint8_t type, const uint8_t *data, uint16_t size)
+{
+    switch (type)
     {
-	DEBUG("TAP write failed (errno=%d)\n", errno);
-	return false;
+	case CTL_READY:
+	    // Asking server to give us our previous session
+	    if (has_session) src->sendCtl(CTL_RESUME, session, 16);
+	    
+	    // Server may link us with other clients directly
+	    src->sendCtl(CTL_SHORTCUT, 0, 0);
+	    return true;
+	
+	case CTL_SESSION:
+	    if (size != 16) return false;
+	    memcpy(session, data, 16);
+	    has_session=true;
+	    return true;
+	
+	case CTL_SC_LISTEN:
+	case CTL_SC_CONNECT:
+	    return shortcut_client_ctl(src, type, data, size);
     }
     
+    // Unknown message
     return true;
 }
 
 
-int start_client(const char *dev, const char *host, int port, int keepalive)
+int start_client(const char *dev, char **hosts, int *ports, int servers, int keepalive)
 {
     // Opening TAP
     dev=tap_open(dev);
     if (! dev) return 0;
+    mss_netif(dev);
     
     // Printing TAP name
     printf("%s\n", dev);
@@ -79,7 +106,12 @@ int start_client(const char *dev, const char *host, int port, int keepalive)
 #endif
     
     
+    // Direct links to other clients write to TAP too
+    shortcut_init(writeTap, keepalive);
+    
     // Main work cycle
+    bool reconnect=false;
+    int server=rand() % servers;	// spreading clients between servers
     while (1)
     {
 	struct sockaddr_in addr;
@@ -88,9 +120,15 @@ int start_client(const char *dev, const char *host, int port, int keepalive)
 	uint8_t buf[MAX_PACKET_SIZE];
 	
 	
-	// Waiting 1 sec between tries
-	sleep(1);
+	// Waiting 1 sec between tries (reconnecting at once if connection was just lost)
+	if (! reconnect) sleep(1);
+	
+	// Trying next server if this one doesn't work
+	if ( (! reconnect) && (servers > 1) ) server=(server + 1) % servers;
+	reconnect=false;
 	
+	const char *host=hosts[server];
+	int port=ports[server];
 	DEBUG("Connecting to %s:%d...\n", host,port);
 	
 	// Resolving host name
@@ -127,6 +165,9 @@ int start_client(const char *dev, const char *host, int port, int keepalive)
 	
 	// Creating connection class
 	Conn *conn=new Conn(sock, writeTap, keepalive);
+	conn->ctl=control;
+	time_t connected_t=time(NULL);
+	int events=0;
 	
 	// Connection loop
 	while (1)
@@ -137,25 +178,30 @@ int start_client(const char *dev, const char *host, int port, int keepalive)
 	    struct timeval tv;
 	    int max_fd;
 	    
-	    // Waiting 1sec for incoming events
-	    tv.tv_sec=1;
-	    tv.tv_usec=0;
+	    // Waiting 1sec for incoming events (or spinning in low-latency mode)
+	    int ms=latency_timeout(events);
+	    tv.tv_sec=ms/1000;
+	    tv.tv_usec=(ms%1000)*1000;
 	    
 	    // Creating lists
 	    FD_ZERO(&fds_read);
 	    FD_ZERO(&fds_write);
 	    FD_ZERO(&fds_except);
 	    
-	    FD_SET(tap_fd, &fds_read);
+	    // Reading TAP only if server connection can take packets (slow direct links give theirs to it)
+	    if (! conn->pressure()) FD_SET(tap_fd, &fds_read);
 	    
 	    if (conn->needRead()) FD_SET(sock, &fds_read);
 	    if (conn->needWrite()) FD_SET(sock, &fds_write);
 	    FD_SET(sock, &fds_except);
 	    
 	    max_fd=(sock > tap_fd) ? sock : tap_fd;
+	    int sc_fd=shortcut_fds(&fds_read, &fds_write, &fds_except);
+	    if (sc_fd > max_fd) max_fd=sc_fd;
 	    
 	    // Waiting for events
-	    if (select(max_fd+1, &fds_read, &fds_write, &fds_except, &tv)<0)
+	    events=select(max_fd+1, &fds_read, &fds_write, &fds_except, &tv);
+	    if (events < 0)
 	    {
 		// select failed - skipping it
 		continue;
@@ -164,25 +210,40 @@ int start_client(const char *dev, const char *host, int port, int keepalive)
 	    // Checking for TAP
 	    if (FD_ISSET(tap_fd, &fds_read))
 	    {
-		// Packet from TAP
-		int len=read(tap_fd, buf, sizeof(buf));
+		// Packet from TAP (read into pool buffer, so it's queued without copy)
+		uint8_t *pkt=pool_get();
+		int len=read(tap_fd, pkt+POOL_DATA-4, MAX_PACKET_SIZE);
 		if (len > (4+14))	// TAP header + Ethernet header
 		{
-		    // Sending to server
-		    conn->send(buf+4, len-4);	// removing TAP header
+		    // Sending to server (or straight to client which has dst MAC)
+		    uint8_t *data=pkt+POOL_DATA;	// removing TAP header
+		    Conn *to=shortcut_find(data);
+		    if ( (! to) || (to->st->congested) ) to=conn;	// server relays it while direct link is slow
+		    if (acl_pass(0, 0, ACL_OUT, data, len-4))
+		    {
+			mss_clamp(data, len-4);
+			capture(to, data, len-4, CAPTURE_OUT);
+			to->send(data, len-4, pkt);
+		    } else
+			PROBE2(deny, 0, len-4);
 		} else
 		{
 		    DEBUG("Error reading from TAP (errno=%d)\n", errno);
 		}
+		pool_put(pkt);
 	    }
 	    
 	    // Checking for server connection
 	    if (FD_ISSET(sock, &fds_read)) conn->doRead();
 	    if (FD_ISSET(sock, &fds_write)) conn->doWrite();
+	    shortcut_events(&fds_read, &fds_write, &fds_except);
+	    cycles_check();
 	    if ( (FD_ISSET(sock, &fds_except)) || (conn->needClose()) )
 	    {
 		// Connection closed
+		reconnect=(conn->readKey != 0) && (time(NULL) > connected_t+1);
 		delete conn;
+		shortcut_close();	// server links us again after reconnect
 		DEBUG("Server connection closed\n");
 		break;
 	    }
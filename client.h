@@ -2,7 +2,11 @@
 #define CLIENT_H
 
 
-int start_client(const char *dev, const char *host, int port, int keepalive);
+#define MAX_SERVERS	8
+
+
+// Connecting to one of servers (switching to next one if it fails)
+int start_client(const char *dev, char **hosts, int *ports, int servers, int keepalive);
 
 
 #endif
@@ -0,0 +1,70 @@
+#include "codec.h"
+
+#include "debug.h"
+
+
+uint16_t crc16_tab[256];
+uint32_t crc32c_tab[256];
+
+
+// Filling tables at startup
+static struct tables
+{
+    tables()
+    {
+	for (int i=0; i<256; i++)
+	{
+	    uint8_t b=i;
+	    crc16_tab[i]=crc16(0, &b, 1);	// reflected 0xA001
+	    
+	    uint32_t c=i;
+	    for (int j=0; j<8; j++)
+		c=(c & 1) ? ((c >> 1) ^ 0x82F63B78) : (c >> 1);	// reflected Castagnoli
+	    crc32c_tab[i]=c;
+	}
+    }
+} tables;
+
+
+// Instances
+typedef Codec<XteaCipher, Crc16Check, Block16Framing>	XteaCrc16;
+typedef Codec<XteaCipher, Crc32cCheck, Block16Framing>	XteaCrc32c;
+
+#define SUITE(id, name, codec)	{ id, name, codec::size, codec::encode, codec::decode }
+
+// Higher id is better
+static const struct suite suites[]=
+{
+    SUITE(SUITE_LEGACY,	"xtea-crc16",	XteaCrc16),
+    SUITE(1,		"xtea-crc32c",	XteaCrc32c),
+};
+#define SUITES	(sizeof(suites)/sizeof(suites[0]))
+
+
+const struct suite* suite_find(uint8_t id)
+{
+    for (unsigned i=0; i<SUITES; i++)
+	if (suites[i].id == id) return &suites[i];
+    
+    return 0;
+}
+
+
+uint8_t suite_caps()
+{
+    uint8_t caps=0;
+    for (unsigned i=0; i<SUITES; i++)
+	caps|=1 << suites[i].id;
+    
+    return caps;
+}
+
+
+const struct suite* suite_pick(uint8_t caps)
+{
+    const struct suite *best=&suites[0];
+    for (unsigned i=0; i<SUITES; i++)
+	if ( (caps & (1 << suites[i].id)) && (suites[i].id > best->id) ) best=&suites[i];
+    
+    return best;
+}
@@ -0,0 +1,141 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crypt.h"
+
+
+// Length flags (top bit of frame length, control messages use it)
+#define FRAME_FLAGS	0x8000
+
+
+// Cipher policies (work on 16-byte blocks)
+struct XteaCipher
+{
+    static inline void encrypt(uint8_t *blk, const uint8_t *key) { encrypt128(blk, key); }
+    static inline void decrypt(uint8_t *blk, const uint8_t *key) { decrypt128(blk, key); }
+};
+
+
+// Integrity policies (check value is stored little-endian after data)
+extern uint16_t crc16_tab[256];
+extern uint32_t crc32c_tab[256];
+
+struct Crc16Check
+{
+    enum { SIZE=2 };
+    
+    // Same as crc16(0xffff, ...), but byte at a time
+    static inline uint32_t calc(const uint8_t *data, uint16_t len)
+    {
+	uint16_t crc=0xffff;
+	while (len--) crc=(crc >> 8) ^ crc16_tab[(crc ^ (*data++)) & 0xff];
+	return crc;
+    }
+};
+
+struct Crc32cCheck
+{
+    enum { SIZE=4 };
+    
+    static inline uint32_t calc(const uint8_t *data, uint16_t len)
+    {
+	uint32_t crc=0xffffffff;
+#ifdef __SSE4_2__
+	// CPU does it itself
+	while (len >= 8)
+	{
+	    uint64_t v;
+	    memcpy(&v, data, 8);
+	    crc=__builtin_ia32_crc32di(crc, v);
+	    data+=8;
+	    len-=8;
+	}
+	while (len--) crc=__builtin_ia32_crc32qi(crc, *data++);
+#else
+	while (len--) crc=(crc >> 8) ^ crc32c_tab[(crc ^ (*data++)) & 0xff];
+#endif
+	return ~crc;
+    }
+};
+
+
+// Framing policies (size of encrypted part for given contents)
+struct Block16Framing
+{
+    static inline uint16_t size(uint16_t len) { return (len+15) & ~15; }
+    static inline bool valid(uint16_t size) { return (size & 15) == 0; }
+};
+
+
+// Frame: [length+flags(2), data, check, padding] encrypted by blocks
+// (one instance per policy combination, so everything is inlined into its loops)
+template <class Cipher, class Check, class Framing>
+struct Codec
+{
+    static uint16_t size(uint16_t len)
+    {
+	return Framing::size(2 + len + Check::SIZE);
+    }
+    
+    static void encode(uint8_t *out, const uint8_t *data, uint16_t len, uint16_t flags, const uint8_t *key)
+    {
+	uint16_t sz=size(len);
+	
+	out[0]=len & 0xff;	// length-low
+	out[1]=(len >> 8) | (flags >> 8);	// length-high + flags
+	memcpy(out+2, data, len);
+	
+	uint32_t c=Check::calc(out, len+2);
+	for (int i=0; i<Check::SIZE; i++)
+	    out[2+len+i]=c >> (i*8);
+	memset(out+2+len+Check::SIZE, 0, sz-(2+len+Check::SIZE));	// padding
+	
+	for (uint16_t offs=0; offs<sz; offs+=16)
+	    Cipher::encrypt(out+offs, key);
+    }
+    
+    // Decrypting frame in place, returns data length (data starts at buf+2) or -1 if frame is bad
+    static int decode(uint8_t *buf, uint16_t sz, uint16_t *flags, const uint8_t *key)
+    {
+	if (! Framing::valid(sz)) return -1;
+	
+	for (uint16_t offs=0; offs<sz; offs+=16)
+	    Cipher::decrypt(buf+offs, key);
+	
+	uint16_t len=buf[0] | (buf[1] << 8);
+	(*flags)=len & FRAME_FLAGS;
+	len&=~FRAME_FLAGS;
+	if (2 + len + Check::SIZE > sz) return -1;
+	
+	uint32_t c=0;
+	for (int i=0; i<Check::SIZE; i++)
+	    c|=(uint32_t)buf[2+len+i] << (i*8);
+	if (Check::calc(buf, len+2) != c) return -1;
+	
+	return len;
+    }
+};
+
+
+// Combinations known to this build (picked at handshake)
+struct suite
+{
+    uint8_t id;	// bit in caps
+    const char *name;
+    uint16_t (*size)(uint16_t len);
+    void (*encode)(uint8_t *out, const uint8_t *data, uint16_t len, uint16_t flags, const uint8_t *key);
+    int (*decode)(uint8_t *buf, uint16_t sz, uint16_t *flags, const uint8_t *key);
+};
+
+#define SUITE_LEGACY	0	// xtea-crc16 (understood by everybody)
+
+const struct suite* suite_find(uint8_t id);
+uint8_t suite_caps();	// ids of all suites as bits
+const struct suite* suite_pick(uint8_t caps);	// best suite both sides have
+
+
+#endif
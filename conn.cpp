@@ -5,10 +5,24 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "crypt.h"
+#include "acl.h"
+#include "tenant.h"
+#include "capture.h"
+#include "handover.h"
+#include "pool.h"
+#include "codec.h"
+#include "latency.h"
+#include "mss.h"
+#include "cycles.h"
+#include "probe.h"
 #include "debug.h"
 
 
@@ -16,10 +30,135 @@
 #define MAX_PKT_SIZE	1600	// eth frame + headers
 
 // Maximum queue size
-#define MAX_Q_SIZE	131072
+#define MAX_Q_SIZE	queue_size
+
+// Queue watermarks: reading local netif stops above high and restarts below low
+#define Q_HIGH		(MAX_Q_SIZE*3/4)
+#define Q_LOW		(MAX_Q_SIZE/4)
+
+// Data taken from one connection per wakeup (poll reports the rest again after everybody's turn)
+#define READ_BUDGET	16384
+#define READ_BUDGET_FRAMES 32
+
+// Frames encrypted for one write (socket's free space limits it too)
+#define WRITE_BATCH	65536
+#define WRITE_BATCH_FRAMES 256
+
+// Waiting band is sent after so many packets of upper bands
+#define PRIO_GUARD	16
+
+// Congested connection which can't write anything for so long doesn't stop local netif
+#define STALL_TIME	2
+
+// Length flag of control messages
+#define CTL_FLAG	FRAME_FLAGS
+
+// Hello frame of peers with control messages support: header, then role of sender
+#define HELLO_ROLE	21
+#define HELLO_LEN	22
+#define HELLO_SERVER	1
+#define HELLO_CLIENT	2
+
+// Pings of peer which echoes them: every PING_RTOS retransmission timeouts (at least PING_MIN sec),
+// peer is dead after PING_LOST periods of silence
+#define PING_MIN	1
+#define PING_RTOS	8
+#define PING_LOST	3
+
+// No ping until peer understands control messages
+#define PING_NEVER	((time_t)0x7fffffff)
+
+// Sec for peer of server with tenants to send first frame after its seed (keepalives don't count)
+#define PROBE_TIME	10
 
 
 int Conn::mac_table_size=8;
+int Conn::group_table_size=32;
+int Conn::throttled_num=0;
+int Conn::handshakes_num=0;
+int Conn::queue_size=131072;
+
+
+// Free queue elements kept for reuse
+#define Q_KEEP		4096
+
+// Frames are received at this offset of pool buffer (decoded data starts at POOL_DATA)
+#define RD_FRAME	(POOL_DATA-2)
+
+
+static struct Conn::outq *free_q=0;
+static int free_q_num=0;
+
+
+// Queue element referencing packet (takes caller's reference of pool buffer),
+// frame is ready to send until codec is set
+static struct Conn::outq* newq(uint8_t *buf, uint16_t len)
+{
+    struct Conn::outq *q=free_q;
+    if (q)
+    {
+	free_q=q->next;
+	free_q_num--;
+    } else
+	q=new struct Conn::outq;
+    
+    q->buf=buf;
+    q->len=len;
+    q->suite=0;
+    q->flags=0;
+    q->next=0;
+    return q;
+}
+
+
+// Bytes queue element takes on the wire
+static inline uint16_t qsize(const struct Conn::outq *q)
+{
+    return (q->suite) ? q->suite->size(q->len)+2 : q->len;
+}
+
+
+// Frame of queue element as it goes to socket (plaintext is encrypted by codec it was queued with)
+static uint16_t wireq(const struct Conn::outq *q, uint8_t *out, const uint8_t *key)
+{
+    if (! q->suite)
+    {
+	memcpy(out, q->buf, q->len);
+	return q->len;
+    }
+    
+    uint16_t sz=q->suite->size(q->len);
+    out[0]=sz & 0xff;	// raw-length-low
+    out[1]=sz >> 8;	// raw-length-high
+    q->suite->encode(out+2, q->buf+POOL_DATA, q->len, q->flags, key);
+    return sz+2;
+}
+
+
+static void freeq(struct Conn::outq *q)
+{
+    pool_put(q->buf);
+    
+    if (free_q_num >= Q_KEEP)
+    {
+	delete q;
+	return;
+    }
+    q->next=free_q;
+    free_q=q;
+    free_q_num++;
+}
+
+
+// Link-local group address which bridges never forward and local experimental EtherType,
+// so older peers' netifs just drop hello
+static const uint8_t hello_hdr[HELLO_ROLE]=
+{
+    0x01, 0x80, 0xc2, 0x00, 0x00, 0x0f,	// dst
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	// src
+    0x88, 0xb5,				// type
+    'T', 'i', 'n', 'y', 'T', 'U', 'N'
+};
 
 
 Conn::Conn(int _sock, pktHandler _handler, int keepalive)
@@ -28,6 +167,21 @@ Conn::Conn(int _sock, pktHandler _handler, int keepalive)
     
     sock=_sock;
     handler=_handler;
+    ctl=0;
+    st=&own_st;
+    
+    // Remembering peer address
+    struct sockaddr_in sa;
+    socklen_t sa_len=sizeof(sa);
+    if (getpeername(sock, (struct sockaddr*)&sa, &sa_len) == 0)
+    {
+	addr=sa.sin_addr.s_addr;
+	port=sa.sin_port;
+    } else
+    {
+	addr=0;
+	port=0;
+    }
     if (keepalive==0)
     {
 	// Server
@@ -41,32 +195,68 @@ Conn::Conn(int _sock, pktHandler _handler, int keepalive)
 	keepalive_timeout=keepalive + keepalive/2;	// 1.5x for timeout
 	keepalive_answer=false;
     }
+    st->throttled=0;
     
-    fin=false;
+    st->fin=false;
+    ext=false;
+    peer=false;
+    outgoing=false;
+    shortcuts=false;
+    peer_id=0;
     
     rd.state=0;
     rd.buf=0;
     
     wr.pos=0;
+    wr.band=0;
+    wr.switching=false;
     
-    outq=0;
-    outq_tail=&outq;
-    outq_size=0;
+    for (uint8_t b=0; b<PRIO_BANDS; b++)
+    {
+	outq[b]=0;
+	outq_tail[b]=&outq[b];
+	outq_skip[b]=0;
+    }
+    st->outq_size=0;
+    st->congested=false;
+    pfd=0;
     
     // Write key
     rand128(writeKey);	// making seed
     sendRaw(writeKey, 16);	// sending it to peer
     encrypt128(writeKey, key128);	// making write key
     
-    // No read key for now
+    // No read key for now (server with tenants changes write key when peer's one is known)
     readKey=0;
+    handshakes_num++;
+    tenant=0;
+    rsuite=wsuite=suite_find(SUITE_LEGACY);
     
     // Empty MAC table
     mac_table=0;
+    mac_table_len=mac_table_size;
+    
+    // No multicast groups
+    group_table=0;
+    
+    // No session
+    memset(session, 0, sizeof(session));
+    
+    // Clearing counters
+    rx_pkts=tx_pkts=0;
+    rx_bytes=tx_bytes=0;
+    memset(&in_bucket, 0, sizeof(in_bucket));
+    memset(&out_bucket, 0, sizeof(out_bucket));
     
     // Setting timeouts
-    timeout_t=time(NULL) + keepalive_timeout;
-    keepalive_t=time(NULL) + keepalive_period;
+    st->timeout_t=time(NULL) + keepalive_timeout;
+    st->keepalive_t=time(NULL) + keepalive_period;
+    write_t=rx_t=time(NULL);
+    
+    // No round trips measured yet (first ping goes right after peer has control messages)
+    ping_period=dead_time=0;
+    st->ping_t=PING_NEVER;
+    rtt=rtt_var=rtt_min=0;
     
     // Setting TCP no-delay (speeds up traffic 2x times)
     int value = 1;
@@ -74,6 +264,8 @@ Conn::Conn(int _sock, pktHandler _handler, int keepalive)
     {
 	DEBUG("Warning: can't set TCP_NODELAY option\n");
     }
+    
+    latency_socket(sock);
 }
 
 
@@ -81,49 +273,61 @@ Conn::~Conn()
 {
     DEBUG("Conn: closed\n");
     
-    if (!fin) close(sock);
+    if (!st->fin) close(sock);
+    if (st->throttled) throttled_num--;
+    if ( (! readKey) && (tenant != TENANT_PROBING) ) handshakes_num--;
     
-    if (rd.buf) delete[] rd.buf;
+    pool_put(rd.buf);
+    dropQueue();
     
-    while (outq)
-    {
-	delete[] outq->buf;
-	struct outq *n=outq->next;
-	delete outq;
-	outq=n;
-    }
+    if ( (mac_table) && (mac_table != mac_inline) ) delete[] mac_table;
     
-    if (readKey) delete[] readKey;
-    
-    if (mac_table) delete[] mac_table;
+    if (group_table) delete[] group_table;
 }
 
 
 bool Conn::needRead()
 {
-    return true;
+    return ! (st->throttled & THROTTLE_IN);
 }
 
 
 void Conn::doRead()
 {
-    uint8_t buf[1024];
+    static uint8_t buf[16384];	// shared by all connections
     
-    // Reading all available data in the socket
-    while (1)
+    // Reading available data in the socket (up to budget)
+    int budget=READ_BUDGET, frames=0;
+    while ( (budget > 0) && (frames < READ_BUDGET_FRAMES) )
     {
-        int len=read(sock, buf, sizeof(buf));
+	// Client over its rate is left in TCP's hands (nothing is decrypted just to be dropped)
+	int want=(budget < (int)sizeof(buf)) ? budget : sizeof(buf);
+	if (limited(THROTTLE_IN))
+	{
+	    if (! bucket_ok(&in_bucket, &rate_in, bucket_now()))
+	    {
+		throttle(THROTTLE_IN);
+		return;
+	    }
+	    if ( (rate_in.bytes) && (in_bucket.bytes < want) ) want=in_bucket.bytes;
+	}
+	
+	CYCLES_START(t);
+        int len=read(sock, buf, want);
+	CYCLES_END(CYC_READ, t);
+	PROBE2(read, this, len);
 	if (len<=0)
 	{
 	    if ( (len==0) || (errno != EAGAIN) )
 	    {
 		// Closed or error
-		fin=true;
-		close(sock);
+		closeSock();
 	    }
 	    return;
 	}
 	DEBUG("Conn: read %d\n", len);
+	budget-=len;
+	if (limited(THROTTLE_IN)) bucket_take(&in_bucket, len, 0);
 	
 	// Splitting data to packets
 	uint8_t *data=buf;
@@ -144,12 +348,11 @@ void Conn::doRead()
 		    rd.state++;
 		    len--;
 		    if ( (rd.len > MAX_PKT_SIZE) ||
-			 ((rd.buf=new uint8_t[rd.len])==NULL) )
+			 ((rd.buf=pool_get())==NULL) )
 		    {
 			// Bad packet size or buffer allocation failed
 			DEBUG("Conn: bad packet size\n");
-			fin=true;
-			close(sock);
+			closeSock();
 			return;
 		    }
 		    rd.pos=0;
@@ -160,7 +363,7 @@ void Conn::doRead()
 		    {
 			int l=rd.len-rd.pos;
 			if (l > len) l=len;
-			memcpy(rd.buf+rd.pos, data, l);
+			memcpy(rd.buf+RD_FRAME+rd.pos, data, l);
 			data+=l;
 			len-=l;
 			rd.pos+=l;
@@ -172,13 +375,15 @@ void Conn::doRead()
 			    {
 				// Bad packet
 				DEBUG("Conn: bad packet\n");
-				fin=true;
-				close(sock);
+				closeSock();
 				return;
 			    }
 			    
+			    frames++;
+			    if (limited(THROTTLE_IN)) bucket_take(&in_bucket, 0, 1);
+			    
 			    // Restarting receiption
-			    delete[] rd.buf;
+			    pool_put(rd.buf);
 			    rd.buf=0;
 			    rd.pos=0;
 			    rd.state=0;
@@ -193,64 +398,333 @@ void Conn::doRead()
 
 bool Conn::needWrite()
 {
-    if ( (! outq) && (time(NULL) > keepalive_t) )
+    if ( (st->outq_size == 0) && (time(NULL) > st->keepalive_t) )
     {
 	// Time to send keepalive
 	sendRaw(0, 0);	// empty packet
     }
     
-    return outq != 0;
+    // Measuring round trip (even while traffic flows)
+    if ( (ext) && (readKey) && (time(NULL) >= st->ping_t) ) ping();
+    
+    return (st->outq_size > 0) && (! (st->throttled & THROTTLE_OUT));
+}
+
+
+uint8_t Conn::nextBand()
+{
+    // Finishing packet in progress
+    if (wr.pos > 0) return wr.band;
+    
+    // Lower band which has waited too long goes first (not while CTL_SWITCH waits in top band), then upper one
+    uint8_t band=PRIO_BANDS;
+    for (uint8_t b=PRIO_BANDS-1; (b>0) && (! wr.switching); b--)
+    {
+	if ( (outq[b]) && (outq_skip[b] >= PRIO_GUARD) )
+	{
+	    band=b;
+	    break;
+	}
+    }
+    for (uint8_t b=0; (b<PRIO_BANDS) && (band == PRIO_BANDS); b++)
+	if (outq[b]) band=b;
+    if (band == PRIO_BANDS) return band;	// nothing queued
+    
+    // Bands below it are waiting
+    outq_skip[band]=0;
+    for (uint8_t b=band+1; b<PRIO_BANDS; b++)
+	if ( (outq[b]) && (outq_skip[b] < PRIO_GUARD) ) outq_skip[b]++;
+    
+    wr.band=band;
+    return band;
+}
+
+
+// Bytes socket takes now (frames encrypted for full socket would be wasted)
+static int sockRoom(int sock)
+{
+    int sndbuf=0, queued=0;
+    socklen_t l=sizeof(sndbuf);
+    
+    if (latency_mode)
+    {
+	// Kernel stops taking data at unsent low watermark
+	if (ioctl(sock, SIOCOUTQNSD, &queued) == 0) return NOTSENT_LOWAT-queued;
+    } else
+    if ( (getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &l) == 0) && (ioctl(sock, SIOCOUTQ, &queued) == 0) )
+	return sndbuf-queued;
+    
+    return WRITE_BATCH;
 }
 
 
 void Conn::doWrite()
 {
-    while (outq != 0)
+    static uint8_t batch[WRITE_BATCH];	// shared by all connections
+    static struct outq *item[WRITE_BATCH_FRAMES];
+    static uint8_t item_band[WRITE_BATCH_FRAMES];
+    static int item_end[WRITE_BATCH_FRAMES];
+    
+    while (st->outq_size > 0)
     {
-	int len=write(sock, outq->buf+wr.pos, outq->len-wr.pos);
-	if (len<=0)
+	// Client over its rate waits for tokens (its queue fills up meanwhile)
+	bool lim=limited(THROTTLE_OUT);
+	if ( (wr.pos == 0) && (lim) && (! bucket_ok(&out_bucket, &rate_out, bucket_now())) )
 	{
-	    if ( (len==0) || (errno != EAGAIN) )
+	    throttle(THROTTLE_OUT);
+	    return;
+	}
+	
+	// Encrypting only what socket and rate limit take now (at least one frame)
+	int room=sockRoom(sock), frames=WRITE_BATCH_FRAMES;
+	if ( (lim) && (rate_out.bytes) && (out_bucket.bytes < room) ) room=out_bucket.bytes;
+	if ( (lim) && (rate_out.frames) && (out_bucket.frames/1000+1 < frames) ) frames=out_bucket.frames/1000+1;
+	
+	// Taking frames from bands in sending order
+	CYCLES_START(te);
+	int len=0, n=0;
+	uint16_t skip=wr.pos;	// part of first frame written before
+	while ( (n < frames) && ( (n == 0) || (len < room) ) && (len <= WRITE_BATCH-POOL_BUF_SIZE) )
+	{
+	    uint8_t b=nextBand();
+	    if (b == PRIO_BANDS) break;
+	    struct outq *q=outq[b];
+	    outq[b]=q->next;
+	    if (! outq[b]) outq_tail[b]=&outq[b];
+	    wr.pos=0;
+	    
+	    if ( (n == 0) && (skip > 0) )
+	    {
+		// Rest of frame in progress is ready (only first item)
+		memcpy(batch, q->buf+skip, q->len-skip);
+		len=q->len-skip;
+	    } else
+		len+=wireq(q, batch+len, writeKey);
+	    item[n]=q;
+	    item_band[n]=b;
+	    item_end[n++]=len;
+	}
+	CYCLES_END(CYC_ENCODE, te);
+	
+	CYCLES_START(tw);
+	int w=::send(sock, batch, len, MSG_NOSIGNAL);	// peer which has reset connection is just closed
+	CYCLES_END(CYC_WRITE, tw);
+	PROBE3(write, this, w, n);
+	int done=0;
+	if (w > 0)
+	{
+	    DEBUG("Conn: write %d of %d (%d frames)\n", w, len, n);
+	    write_t=time(NULL);
+	    
+	    // Finished frames
+	    for (; (done < n) && (item_end[done] <= w); done++)
+	    {
+		struct outq *q=item[done];
+		uint16_t sz=qsize(q);
+		if (lim) bucket_take(&out_bucket, sz, 1);
+		st->outq_size-=sz;
+		freeq(q);
+	    }
+	    
+	    // Frame in progress keeps its ciphertext (rest of it goes first next time)
+	    int start=(done > 0) ? item_end[done-1] : 0;
+	    if ( (done < n) && (w > start) )
+	    {
+		struct outq *q=item[done];
+		if (q->suite)
+		{
+		    uint8_t *buf=pool_get();
+		    memcpy(buf, batch+start, item_end[done]-start);
+		    pool_put(q->buf);
+		    q->buf=buf;
+		    q->len=item_end[done]-start;
+		    q->suite=0;
+		}
+		wr.pos=((done == 0) ? skip : 0) + w-start;
+		wr.band=item_band[done];
+	    }
+	} else
+	if (skip > 0)
+	{
+	    wr.pos=skip;
+	    wr.band=item_band[0];
+	}
+	
+	// Unsent frames go back to heads of their bands
+	for (int i=n-1; i>=done; i--)
+	{
+	    uint8_t b=item_band[i];
+	    item[i]->next=outq[b];
+	    if (! outq[b]) outq_tail[b]=&item[i]->next;
+	    outq[b]=item[i];
+	}
+	
+	// CTL_SWITCH is written when top band it was merged into is
+	if (! outq[PRIO_HIGH]) wr.switching=false;
+	
+	if (w<=0)
+	{
+	    if ( (w==0) || (errno != EAGAIN) )
 	    {
 		// Closed or error
-		fin=true;
-		close(sock);
+		closeSock();
 	    }
 	    return;
 	}
-	DEBUG("Conn: write %d\n", len);
 	
-	wr.pos+=len;
-	if (wr.pos >= outq->len)
+	if ( (st->outq_size == 0) && (pfd) ) pfd->events&=~POLLOUT;
+	
+	// Frames from local netif are taken again
+	if ( (st->congested) && (st->outq_size < Q_LOW) )
 	{
-	    // Packet finished
-	    wr.pos=0;
-	    outq_size-=outq->len;
-	    delete[] outq->buf;
-	    struct outq *n=outq->next;
-	    delete outq;
-	    outq=n;
-	    
-	    // If no more packets - pointing tail to outq
-	    if (! outq) outq_tail=&outq;
+	    DEBUG("Conn: queue drained\n");
+	    st->congested=false;
 	}
+	
+	// Socket is full
+	if (w < len) return;
     }
 }
 
 
+bool Conn::limited(uint8_t dir)
+{
+    // Links to other servers are never limited (server gives peer role only to its --peer ones)
+    return (! peer) && (rate_set((dir == THROTTLE_IN) ? &rate_in : &rate_out));
+}
+
+
+void Conn::throttle(uint8_t dir)
+{
+    DEBUG("Conn: throttled (%s)\n", (dir == THROTTLE_IN) ? "in" : "out");
+    if (! st->throttled) throttled_num++;
+    st->throttled|=dir;
+    
+    if (pfd) pfd->events&=(dir == THROTTLE_IN) ? ~POLLIN : ~POLLOUT;
+}
+
+
+void Conn::unthrottle()
+{
+    if (! st->throttled) return;
+    
+    uint32_t now=bucket_now();
+    if ( (st->throttled & THROTTLE_IN) && ( (! limited(THROTTLE_IN)) || (bucket_ok(&in_bucket, &rate_in, now)) ) )
+    {
+	st->throttled&=~THROTTLE_IN;
+	if (pfd) pfd->events|=POLLIN;
+    }
+    if ( (st->throttled & THROTTLE_OUT) && ( (! limited(THROTTLE_OUT)) || (bucket_ok(&out_bucket, &rate_out, now)) ) )
+    {
+	st->throttled&=~THROTTLE_OUT;
+	if ( (pfd) && (st->outq_size > 0) ) pfd->events|=POLLOUT;
+    }
+    
+    if (! st->throttled) throttled_num--;
+}
+
+
+void Conn::closeSock()
+{
+    st->fin=true;
+    close(sock);
+    if (pfd) pfd->fd=-1;
+}
+
+
+bool Conn::pressure()
+{
+    // Rate limited client doesn't hold everybody else
+    return (st->congested) && (! (st->throttled & THROTTLE_OUT)) && (time(NULL) <= write_t + STALL_TIME);
+}
+
+
 bool Conn::needClose()
 {
-    return fin || (time(NULL) > timeout_t);
+    if (st->fin) return true;
+    if (time(NULL) <= st->timeout_t) return false;
+    
+    // Peer's answers may be stuck behind data we've sent, it's alive while TCP gets acks
+    if ( (dead_time) && (time(NULL) <= rx_t + keepalive_timeout) && (tcpAlive()) )
+    {
+	st->timeout_t=time(NULL);	// checking again in a second
+	return false;
+    }
+    return true;
+}
+
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+void Conn::ping()
+{
+    // Peer which doesn't echo is pinged as often as keepalives go (older ones just ignore it)
+    uint64_t now=now_us();
+    sendCtl(CTL_PING, (const uint8_t*)&now, 8);
+    st->ping_t=time(NULL) + ((ping_period) ? ping_period : keepalive_period);
+}
+
+
+void Conn::rttSample(uint32_t us)
+{
+    if (us == 0) us=1;
+    
+    // Smoothed round trip and its mean deviation (as TCP does, RFC 6298)
+    if (! rtt)
+    {
+	rtt=us;
+	rtt_var=us/2;
+	rtt_min=us;
+    } else
+    {
+	int32_t d=(int32_t)us-(int32_t)rtt;
+	rtt_var+=((d < 0 ? -d : d) - (int32_t)rtt_var)/4;
+	rtt+=d/8;
+	if (us < rtt_min) rtt_min=us;
+    }
+    PROBE3(rtt, this, us, rtt);
+    
+    // Pinging more often on fast paths, so dead peer is noticed in a few seconds
+    uint64_t rto=rtt + 4*rtt_var;	// usec
+    uint32_t period=(PING_RTOS*rto + 999999)/1000000;	// sec, rounded up
+    if (period < PING_MIN) period=PING_MIN;
+    if (period > keepalive_period) period=keepalive_period;
+    uint32_t dead=PING_LOST*period + (rto + 999999)/1000000;
+    if (dead > keepalive_timeout) dead=keepalive_timeout;
+    ping_period=period;
+    dead_time=dead;
+    
+    st->timeout_t=rx_t + dead_time;
+}
+
+
+bool Conn::tcpAlive()
+{
+    struct tcp_info ti;
+    socklen_t l=sizeof(ti);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &l) != 0) return false;
+    
+    // Something is in flight and peer has acked data lately
+    return (ti.tcpi_unacked > 0) && (ti.tcpi_last_ack_recv < dead_time*1000u);
 }
 
 
 bool Conn::handlePkt()
 {
-    // Updating keepalive timeout
-    timeout_t=time(NULL)+keepalive_timeout;
+    uint8_t *frame=rd.buf+RD_FRAME;
+    
+    // Updating keepalive timeout (peer whose tenant is being found has fixed deadline)
+    rx_t=time(NULL);
+    if (tenant != TENANT_PROBING) st->timeout_t=rx_t + ((dead_time) ? dead_time : keepalive_timeout);
     
     // Checking for key
-    if (! readKey)
+    if ( (! readKey) && (tenant != TENANT_PROBING) )
     {
 	// First packet must be read key
 	
@@ -261,18 +735,37 @@ bool Conn::handlePkt()
 	    return false;
 	}
 	
-	// Making read key
-	readKey=new uint8_t[16];
-	if (! readKey) return false;
-	memcpy(readKey, rd.buf, 16);
-	encrypt128(readKey, key128);
+	memcpy(read_key, frame, 16);
+	handshakes_num--;
 	
-	// Checking that readKey != writeKey
-	if (memcmp(readKey, writeKey, 16)==0) return false;
+	// Server with tenants doesn't know yet which key peer has
+	if (tenant == TENANT_UNKNOWN)
+	{
+	    tenant=TENANT_PROBING;
+	    st->timeout_t=rx_t + PROBE_TIME;
+	    return true;
+	}
 	
-	// Key is ok
-	DEBUG("Conn: got readKey\n");
-	return true;
+	return gotKey(key128);
+    }
+    
+    if (! readKey)
+    {
+	// Keepalive tells nothing, first frame shows whose key peer has
+	if (rd.len==0) return true;
+	int t=findTenant();
+	if (t < 0) return false;
+	
+	// Our seed is encrypted with that key too
+	tenant=t;
+	st->timeout_t=rx_t + keepalive_timeout;
+	decrypt128(writeKey, key128);
+	encrypt128(writeKey, tenants[t].key);
+	DEBUG("Conn: tenant %d\n", t);
+	if ( (ctl) && (! ctl(this, CTL_TENANT, 0, 0)) ) return false;
+	if (! gotKey(tenants[t].key)) return false;
+	
+	// Frame is handled as usual then
     }
     
     if (rd.len==0)
@@ -282,150 +775,324 @@ bool Conn::handlePkt()
 	return true;
     }
     
-    // Checking packet length (must be aligned by 16 bytes)
-    if ((rd.len & 15) != 0)
+    // Decrypting & checking packet
+    uint16_t flags;
+    CYCLES_START(t);
+    int l=rsuite->decode(frame, rd.len, &flags, readKey);
+    CYCLES_END(CYC_DECODE, t);
+    if (l < 0)
     {
-	DEBUG("Conn: bad packet length %d\n", rd.len);
+	DEBUG("Conn: bad packet (%s)\n", rsuite->name);
 	return false;
     }
+    uint16_t len=l;
     
-    // Decrypting packet
-    uint16_t offs=0;
-    while (offs < rd.len)
+    if (flags & CTL_FLAG)
     {
-	decrypt128(rd.buf+offs, readKey);
-	offs+=16;
+	// Control message
+	if (len < 1) return false;
+	
+	// Older peers can't send them, so it tells as much as hello
+	if ( (! ext) && (! extReady()) ) return false;
+	
+	DEBUG("Conn: got control message %d size=%d\n", frame[2], len-1);
+	if (frame[2] >= CTL_LOCAL) return true;	// can't be sent
+	
+	// Codec negotiation
+	if (frame[2] == CTL_CAPS)
+	{
+	    if (len < 2) return false;
+	    const struct suite *s=suite_pick(frame[3]);
+	    if (s == wsuite) return true;
+	    
+	    // Frames after this message use new suite (queued ones must not be overtaken by it)
+	    mergeQueue();
+	    if (! sendCtl(CTL_SWITCH, &s->id, 1)) return false;
+	    DEBUG("Conn: switching to %s\n", s->name);
+	    wsuite=s;
+	    wr.switching=true;
+	    return true;
+	}
+	if (frame[2] == CTL_SWITCH)
+	{
+	    if (len < 2) return false;
+	    rsuite=suite_find(frame[3]);
+	    return rsuite != 0;
+	}
+	
+	// Round trip measurement
+	if (frame[2] == CTL_PING)
+	{
+	    if (len != 9) return false;
+	    return sendCtl(CTL_PONG, frame+3, 8);
+	}
+	if (frame[2] == CTL_PONG)
+	{
+	    if (len != 9) return false;
+	    uint64_t sent, now=now_us();
+	    memcpy(&sent, frame+3, 8);
+	    if ( (sent <= now) && (now-sent < 60000000) ) rttSample(now-sent);
+	    return true;
+	}
+	
+	return (ctl) ? ctl(this, frame[2], frame+3, len-1) : true;	// ignoring if nobody wants it
     }
     
-    // Checking length
-    uint16_t len=rd.buf[0] | (rd.buf[1] << 8);
-    if (len+4 > rd.len)
+    // Hello is never forwarded (older server relays our own one, other side's one tells peer is new)
+    if ( (len == HELLO_LEN) && (memcmp(frame+2, hello_hdr, HELLO_ROLE) == 0) )
     {
-	DEBUG("Conn: bad decrypted length %d\n", len);
-	return false;
+	uint8_t role=(keepalive_answer) ? HELLO_SERVER : HELLO_CLIENT;
+	if ( (! ext) && (frame[2+HELLO_ROLE] != role) ) return extReady();
+	return true;
     }
     
-    // Checking CRC
-    if (crc16(0xffff, rd.buf, len+4) != 0x0000)
+    // Counting
+    rx_pkts++;
+    rx_bytes+=len;
+    
+    // Unwanted frame costs nothing more than its check
+    if (! acl_pass(tenant, addr, ACL_IN, frame+2, len))
     {
-	DEBUG("Conn: bad decrypted CRC\n");
-	return false;
+	PROBE2(deny, this, len);
+	return true;
     }
     
     // Remembering src MAC in MAC table
-    addMAC(rd.buf+2+6);
+    CYCLES_START(tl);
+    if ( (addMAC(frame+2+6)) && (ctl) )
+	ctl(this, CTL_LEARN, frame+2+6, 6);
+    CYCLES_END(CYC_LEARN, tl);
+    
+    mss_clamp(frame+2, len);
+    capture(this, frame+2, len, CAPTURE_IN);
     
     // Starting handler
     DEBUG("Conn: got packet size=%d\n", len);
-    return handler(this, rd.buf+2, len);
+    PROBE2(recv, this, len);
+    CYCLES_START(th);
+    bool ok=handler(this, frame+2, len);
+    CYCLES_END(CYC_ROUTE, th);
+    return ok;
 }
 
 
-bool Conn::sendRaw(const uint8_t *data, uint16_t len)
+// Making read key from peer's seed
+bool Conn::gotKey(const uint8_t *key)
 {
-    // Checking maximum queue size
-    if (outq_size+len+2 > MAX_Q_SIZE) return false;
+    readKey=read_key;
+    encrypt128(readKey, key);
     
-    // Creating queue element
-    struct outq *q=new struct outq;
-    if (! q) return false;
-    q->buf=new uint8_t[len+2];	// 2 bytes for length
-    if (! q->buf)
+    // Checking that readKey != writeKey
+    if (memcmp(readKey, writeKey, 16)==0) return false;
+    
+    // Key is ok
+    DEBUG("Conn: got readKey%s\n", ext ? " (ext)" : "");
+    if (ext) return extReady();	// peer is known to be new one
+    
+    // Asking peer whether it has control messages (older one ignores it)
+    uint8_t hello[HELLO_LEN];
+    memcpy(hello, hello_hdr, HELLO_ROLE);
+    hello[HELLO_ROLE]=(keepalive_answer) ? HELLO_SERVER : HELLO_CLIENT;
+    return sendEnc(hello, HELLO_LEN, 0, PRIO_HIGH, 0);
+}
+
+
+// Peer has shown it understands control messages
+bool Conn::extReady()
+{
+    DEBUG("Conn: peer has control messages\n");
+    ext=true;
+    st->ping_t=0;
+    
+    // Telling which codecs we have
+    uint8_t caps=suite_caps();
+    if (! sendCtl(CTL_CAPS, &caps, 1)) return false;
+    
+    return (! ctl) || (ctl(this, CTL_READY, 0, 0));
+}
+
+
+// Index of the only tenant whose key decodes first frame (-1 if none or several do)
+int Conn::findTenant()
+{
+    uint8_t *frame=rd.buf+RD_FRAME;
+    uint8_t buf[rd.len], key[16];
+    int found=-1;
+    
+    for (int t=0; t<tenants_num; t++)
     {
-	// Allocation failed
-	delete q;
-	return false;
+	memcpy(key, read_key, 16);
+	encrypt128(key, tenants[t].key);
+	memcpy(buf, frame, rd.len);
+	
+	uint16_t flags;
+	if (rsuite->decode(buf, rd.len, &flags, key) < 0) continue;
+	
+	// Checks of other keys must fail (or anybody's client could get to other tenant)
+	if (found >= 0)
+	{
+	    DEBUG("Conn: frame fits keys of several tenants\n");
+	    return -1;
+	}
+	found=t;
     }
-    q->buf[0]=len & 0xff;	// length-low
-    q->buf[1]=len >> 8;		// length-high
-    if (len > 0) memcpy(q->buf+2, data, len);
-    q->len=len+2;
-    q->next=0;
-    outq_size+=len+2;
     
-    // Adding to outq
-    (*outq_tail)=q;
-    
-    // Switching outq_tail
-    outq_tail=&(q->next);
+    if (found < 0) DEBUG("Conn: key of no tenant fits\n");
+    return found;
+}
+
+
+bool Conn::sendRaw(const uint8_t *data, uint16_t len)
+{
+    // Checking maximum queue size
+    if (st->outq_size+len+2 > MAX_Q_SIZE) return false;
     
-    // Updating keepalive period
-    keepalive_t=time(NULL) + keepalive_period;
+    // Creating queue element
+    if (len+2 > POOL_BUF_SIZE) return false;
+    uint8_t *buf=pool_get();
+    buf[0]=len & 0xff;	// length-low
+    buf[1]=len >> 8;	// length-high
+    if (len > 0) memcpy(buf+2, data, len);
+    enqueue(newq(buf, len+2), PRIO_HIGH);	// seed must go first, keepalives are tiny
     
     DEBUG("Conn: sent raw packet size=%d\n", len);
     return true;
 }
 
 
-bool Conn::send(const uint8_t *data, uint16_t len)
+bool Conn::send(const uint8_t *data, uint16_t len, uint8_t *pkt)
 {
-    // Calculating size for size+pkt+crc aligned by 16 bytes
-    uint16_t sz=(len+2+2+15) & ~15;	// 2 bytes - size, 2 bytes - crc16
+    // Peer hasn't shown it knows the key yet
+    if (! readKey) return false;
     
-    // Checking maximum queue size
-    if (outq_size+sz+2 > MAX_Q_SIZE) return false;
+    CYCLES_START(t);
+    bool ok=sendEnc(data, len, 0, prio_band(data, len), pkt);
+    CYCLES_END(CYC_SEND, t);
+    if (! ok) return false;
     
-    // Creating queue element
-    struct outq *q=new struct outq;
-    if (! q) return false;
-    q->buf=new uint8_t[sz+2];	// 2 bytes for raw length
-    if (! q->buf)
+    // Counting
+    tx_pkts++;
+    tx_bytes+=len;
+    return true;
+}
+
+
+bool Conn::sendCtl(uint8_t type, const uint8_t *data, uint16_t len)
+{
+    // Peer doesn't know anything about control messages
+    if (! ext) return false;
+    
+    uint8_t buf[len+1];
+    buf[0]=type;
+    if (len > 0) memcpy(buf+1, data, len);
+    
+    DEBUG("Conn: sending control message %d size=%d\n", type, len);
+    return sendEnc(buf, len+1, CTL_FLAG, PRIO_HIGH, 0);
+}
+
+
+bool Conn::sendEnc(const uint8_t *data, uint16_t len, uint16_t flags, uint8_t band, uint8_t *pkt)
+{
+    // Calculating size of encrypted frame
+    uint16_t sz=wsuite->size(len);
+    
+    // Checking maximum queue size
+    if ( (st->outq_size+sz+2 > MAX_Q_SIZE) || (POOL_DATA-2+sz > POOL_BUF_SIZE) )
     {
-	// Allication failed
-	delete q;
+	PROBE2(drop, this, len);
 	return false;
     }
-    q->len=sz+2;
-    q->next=0;
-    outq_size+=sz+1;
-    
-    // Generating packet
-    q->buf[0]=sz & 0xff;	// raw-length-low
-    q->buf[1]=sz >> 8;		// raw-length-high
-    q->buf[2]=len & 0xff;	// length-low
-    q->buf[3]=len >> 8;		// length-high
-    memcpy(q->buf+4, data, len);
-    uint16_t crc=crc16(0xffff, q->buf+2, len+2);	// calculating crc for packet
-    q->buf[4+len+0]=crc & 0xff;	// crc-low
-    q->buf[4+len+1]=crc >> 8;	// crc-high
     
-    // Encryping packet
-    uint16_t offs=0;
-    while (offs < sz)
+    // Queueing plaintext (doWrite() encrypts it), packet's buffer is shared if caller has it
+    uint8_t *buf=( (pkt) && (data == pkt+POOL_DATA) ) ? pkt : 0;
+    if (buf)
+	pool_hold(buf); else
     {
-	encrypt128(q->buf+2+offs, writeKey);
-	offs+=16;
+	buf=pool_get();
+	memcpy(buf+POOL_DATA, data, len);
     }
+    struct outq *q=newq(buf, len);
+    q->suite=wsuite;	// frames queued before CTL_SWITCH keep old codec
+    q->flags=flags;
+    enqueue(q, band);
+    PROBE3(send, this, len, band);
     
-    // Adding to outq
-    (*outq_tail)=q;
+    DEBUG("Conn: sent encrypted packet size=%d band=%d\n", len, band);
+    return true;
+}
+
+
+void Conn::enqueue(struct outq *q, uint8_t band)
+{
+    // Adding to band's tail
+    (*outq_tail[band])=q;
+    outq_tail[band]=&(q->next);
+    st->outq_size+=qsize(q);
     
-    // Switching outq_tail;
-    outq_tail=&(q->next);
+    // Frames from local netif are dropped for connection while its queue is too long
+    if (st->outq_size > Q_HIGH) st->congested=true;
+    if ( (pfd) && (! (st->throttled & THROTTLE_OUT)) ) pfd->events|=POLLOUT;
     
     // Updating keepalive period
-    keepalive_t=time(NULL) + keepalive_period;
+    st->keepalive_t=time(NULL) + keepalive_period;
+}
+
+
+void Conn::mergeQueue()
+{
+    // Everything queued goes to top band in the order it would be sent (packet in progress first)
+    uint8_t first=(wr.pos > 0) ? wr.band : PRIO_HIGH;
+    struct outq *all=outq[first], **tail=(all) ? outq_tail[first] : &all;
+    for (uint8_t b=0; b<PRIO_BANDS; b++)
+    {
+	if ( (b == first) || (! outq[b]) ) continue;
+	(*tail)=outq[b];
+	tail=outq_tail[b];
+    }
     
-    DEBUG("Conn: sent encrypted packet size=%d\n", len);
-    return true;
+    for (uint8_t b=0; b<PRIO_BANDS; b++)
+    {
+	outq[b]=0;
+	outq_tail[b]=&outq[b];
+	outq_skip[b]=0;
+    }
+    outq[PRIO_HIGH]=all;
+    if (all) outq_tail[PRIO_HIGH]=tail;
+    wr.band=PRIO_HIGH;
 }
 
 
-void Conn::addMAC(const uint8_t *mac)
+void Conn::dropQueue()
+{
+    for (uint8_t b=0; b<PRIO_BANDS; b++)
+    {
+	while (outq[b])
+	{
+	    struct outq *n=outq[b]->next;
+	    freeq(outq[b]);
+	    outq[b]=n;
+	}
+	outq_tail[b]=&outq[b];
+	outq_skip[b]=0;
+    }
+    st->outq_size=0;
+    wr.pos=0;
+    wr.band=0;
+    wr.switching=false;
+}
+
+
+bool Conn::addMAC(const uint8_t *mac)
 {
     uint16_t min_use=0xffff;
-    uint8_t min_n=0;
+    uint16_t min_n=0;
     bool found=false, div=false;
     
     // Creating MAC table
-    if (! mac_table)
-    {
-	mac_table=new struct mac_table[mac_table_size];
-	if (! mac_table) return;
-    }
+    if ( (! mac_table) && (! newMACs()) ) return false;
     
     // Looking for MAC in table
-    for (uint8_t i=0; i<mac_table_size; i++)
+    for (uint16_t i=0; i<mac_table_len; i++)
     {
 	if ( (mac_table[i].use > 0) &&
 	     (memcmp(mac_table[i].mac, mac, 6)==0) )
@@ -450,16 +1117,17 @@ void Conn::addMAC(const uint8_t *mac)
     if (div)
     {
 	// Should div all use counters by 2
-	for (uint8_t i=0; i<mac_table_size; i++)
+	for (uint16_t i=0; i<mac_table_len; i++)
 	    mac_table[i].use>>=1;
     }
     
     // Checking if MAC was found
-    if (found) return;
+    if (found) return false;
     
     // Adding MAC to first free slot
     memcpy(mac_table[min_n].mac, mac, 6);
     mac_table[min_n].use=1;
+    return true;
 }
 
 
@@ -469,7 +1137,7 @@ bool Conn::findMAC(const uint8_t *mac)
     if (! mac_table) return false;
     
     // Looking for MAC in table
-    for (uint8_t i=0; i<mac_table_size; i++)
+    for (uint16_t i=0; i<mac_table_len; i++)
     {
 	if ( (mac_table[i].use > 0) &&
 	     (memcmp(mac_table[i].mac, mac, 6)==0) )
@@ -482,3 +1150,324 @@ bool Conn::findMAC(const uint8_t *mac)
     // Not found
     return false;
 }
+
+
+bool Conn::newMACs()
+{
+    // Small tables are kept inside connection
+    if (mac_table_len <= MAC_INLINE)
+    {
+	memset(mac_inline, 0, sizeof(mac_inline));
+	mac_table=mac_inline;
+    } else
+	mac_table=new struct mac_table[mac_table_len]();
+    
+    return mac_table != 0;
+}
+
+
+void Conn::delMAC(const uint8_t *mac)
+{
+    if (! mac_table) return;
+    
+    for (uint16_t i=0; i<mac_table_len; i++)
+    {
+	if ( (mac_table[i].use > 0) &&
+	     (memcmp(mac_table[i].mac, mac, 6)==0) )
+	{
+	    mac_table[i].use=0;
+	    return;
+	}
+    }
+}
+
+
+void Conn::detach()
+{
+    // Closing socket
+    if (! st->fin) closeSock();
+    
+    // Dropping everything in progress
+    pool_put(rd.buf);
+    rd.buf=0;
+    rd.state=0;
+    
+    dropQueue();
+    st->congested=false;
+    if (st->throttled) throttled_num--;
+    st->throttled=0;
+}
+
+
+void Conn::adopt(Conn *old)
+{
+    // Taking MAC table (keeping MACs learned since connect)
+    struct mac_table tmp[MAC_INLINE];
+    struct mac_table *mine=mac_table;
+    uint16_t mine_len=mac_table_len;
+    if (mine == mac_inline)
+    {
+	memcpy(tmp, mac_inline, sizeof(tmp));
+	mine=tmp;
+    }
+    if (old->mac_table == old->mac_inline)
+    {
+	memcpy(mac_inline, old->mac_inline, sizeof(mac_inline));
+	mac_table=mac_inline;
+    } else
+	mac_table=old->mac_table;
+    mac_table_len=old->mac_table_len;
+    old->mac_table=0;
+    if (mine)
+    {
+	for (uint16_t i=0; i<mine_len; i++)
+	    if (mine[i].use > 0) addMAC(mine[i].mac);
+	if (mine != tmp) delete[] mine;
+    }
+    
+    // Taking multicast groups
+    if (! group_table)
+    {
+	group_table=old->group_table;
+	old->group_table=0;
+    }
+    
+    // Taking counters
+    rx_pkts+=old->rx_pkts;
+    tx_pkts+=old->tx_pkts;
+    rx_bytes+=old->rx_bytes;
+    tx_bytes+=old->tx_bytes;
+}
+
+
+void Conn::handover(struct handover_io *s)
+{
+    bool loading=(s->in != 0);
+    uint8_t has;
+    
+    s->io(&addr, sizeof(addr));
+    s->io(&port, sizeof(port));
+    s->io(&st->fin, sizeof(st->fin));
+    s->io(&ext, sizeof(ext));
+    s->io(&peer, sizeof(peer));
+    s->io(&outgoing, sizeof(outgoing));
+    s->io(&shortcuts, sizeof(shortcuts));
+    s->io(&peer_id, sizeof(peer_id));
+    s->io(session, sizeof(session));
+    s->io(&tenant, sizeof(tenant));
+    if ( (loading) && (tenant >= tenants_num) && (tenant < TENANT_PROBING) ) s->ok=false;
+    
+    // Keys & codecs
+    s->io(writeKey, sizeof(writeKey));
+    uint8_t rid=(rsuite) ? rsuite->id : SUITE_LEGACY, wid=(wsuite) ? wsuite->id : SUITE_LEGACY;
+    s->io(&rid, 1);
+    s->io(&wid, 1);
+    if (loading)
+    {
+	rsuite=suite_find(rid);
+	wsuite=suite_find(wid);
+	if ( (! rsuite) || (! wsuite) ) s->ok=false;
+    }
+    has=(readKey != 0);
+    s->io(&has, 1);
+    if (has)
+    {
+	if (loading) readKey=read_key;
+	s->io(readKey, 16);
+    } else
+    if (tenant == TENANT_PROBING)
+	s->io(read_key, 16);	// peer's seed
+    
+    // Packet being received
+    s->io(&rd.state, sizeof(rd.state));
+    s->io(&rd.pos, sizeof(rd.pos));
+    s->io(&rd.len, sizeof(rd.len));
+    if (rd.state == 2)
+    {
+	if (loading)
+	{
+	    if ( (rd.len > MAX_PKT_SIZE) || (rd.pos > rd.len) ) s->ok=false;
+	    if (! s->ok) return;
+	    rd.buf=pool_get();
+	}
+	s->io(rd.buf+RD_FRAME, rd.len);
+    }
+    
+    // Send queue (first packet may be partially written, bands are merged by save())
+    uint32_t n=0;
+    for (struct outq *q=outq[PRIO_HIGH]; q; q=q->next) n++;
+    s->io(&n, sizeof(n));
+    s->io(&wr.pos, sizeof(wr.pos));
+    for (struct outq *q=outq[PRIO_HIGH]; n > 0; n--)
+    {
+	if (loading)
+	{
+	    uint16_t len=0;
+	    s->io(&len, sizeof(len));
+	    if ( (! s->ok) || (len > POOL_BUF_SIZE) )
+	    {
+		s->ok=false;
+		return;
+	    }
+	    
+	    q=newq(pool_get(), len);
+	    s->io(q->buf, len);
+	    enqueue(q, PRIO_HIGH);
+	    wr.switching=true;	// old process may have queued CTL_SWITCH
+	} else
+	{
+	    // Frames are handed over encrypted
+	    uint8_t frame[POOL_BUF_SIZE];
+	    uint16_t len=wireq(q, frame, writeKey);
+	    s->io(&len, sizeof(len));
+	    s->io(frame, len);
+	    q=q->next;
+	}
+    }
+    bool cong=st->congested;
+    s->io(&cong, sizeof(cong));
+    if (loading) st->congested=cong;
+    s->io(&write_t, sizeof(write_t));
+    
+    // Tables
+    has=(mac_table != 0);
+    s->io(&has, 1);
+    s->io(&mac_table_len, sizeof(mac_table_len));
+    if (has)
+    {
+	if (loading)
+	{
+	    if ( (! s->ok) || (! newMACs()) ) return;
+	}
+	s->io(mac_table, sizeof(struct mac_table)*mac_table_len);
+    }
+    
+    has=(group_table != 0);
+    s->io(&has, 1);
+    if (has)
+    {
+	if (loading) group_table=new struct group_table[group_table_size]();
+	s->io(group_table, sizeof(struct group_table)*group_table_size);
+    }
+    
+    // Counters & timeouts
+    s->io(&rx_pkts, sizeof(rx_pkts));
+    s->io(&tx_pkts, sizeof(tx_pkts));
+    s->io(&rx_bytes, sizeof(rx_bytes));
+    s->io(&tx_bytes, sizeof(tx_bytes));
+    s->io(&keepalive_period, sizeof(keepalive_period));
+    s->io(&keepalive_timeout, sizeof(keepalive_timeout));
+    s->io(&keepalive_answer, sizeof(keepalive_answer));
+    s->io(&st->timeout_t, sizeof(st->timeout_t));
+    s->io(&st->keepalive_t, sizeof(st->keepalive_t));
+}
+
+
+uint8_t* Conn::save(uint32_t *len)
+{
+    struct handover_io s;
+    memset(&s, 0, sizeof(s));
+    mergeQueue();	// new process gets one queue in sending order
+    
+    // Counting size
+    handover(&s);
+    (*len)=s.pos;
+    
+    // Saving
+    s.out=new uint8_t[s.pos];
+    s.pos=0;
+    handover(&s);
+    return s.out;
+}
+
+
+Conn* Conn::load(int sock, pktHandler handler, const uint8_t *data, uint32_t len)
+{
+    Conn *c=new Conn();
+    memset((void*)c, 0, sizeof(*c));
+    c->st=&c->own_st;
+    c->sock=sock;
+    c->handler=handler;
+    for (uint8_t b=0; b<PRIO_BANDS; b++)
+	c->outq_tail[b]=&c->outq[b];
+    latency_socket(sock);	// this process may run in other mode
+    
+    struct handover_io s;
+    memset(&s, 0, sizeof(s));
+    s.in=data;
+    s.len=len;
+    s.ok=true;
+    c->handover(&s);
+    if ( (! c->readKey) && (c->tenant != TENANT_PROBING) ) handshakes_num++;
+    if (! c->ext) c->st->ping_t=PING_NEVER;
+    
+    if ( (! s.ok) || (s.pos != len) || ((sock < 0) && (! c->st->fin)) )
+    {
+	DEBUG("Conn: bad handover state\n");
+	c->st->fin=true;	// socket is closed by caller
+	delete c;
+	return 0;
+    }
+    
+    DEBUG("Conn: taken over\n");
+    return c;
+}
+
+
+void Conn::joinGroup(const uint8_t *mac, time_t expire)
+{
+    // Creating group table
+    if (! group_table)
+    {
+	group_table=new struct group_table[group_table_size];
+	if (! group_table) return;
+	memset(group_table, 0, sizeof(struct group_table)*group_table_size);
+    }
+    
+    // Looking for group (or for slot which expires first)
+    uint8_t n=0;
+    for (uint8_t i=0; i<group_table_size; i++)
+    {
+	if (memcmp(group_table[i].mac, mac, 6)==0)
+	{
+	    n=i;
+	    break;
+	}
+	
+	if (group_table[i].expire < group_table[n].expire) n=i;
+    }
+    
+    memcpy(group_table[n].mac, mac, 6);
+    group_table[n].expire=expire;
+}
+
+
+void Conn::leaveGroup(const uint8_t *mac, time_t expire)
+{
+    if (! group_table) return;
+    
+    for (uint8_t i=0; i<group_table_size; i++)
+    {
+	if (memcmp(group_table[i].mac, mac, 6)==0)
+	{
+	    // Other hosts behind this connection may still need it, they'll report it soon
+	    if (group_table[i].expire > expire) group_table[i].expire=expire;
+	    return;
+	}
+    }
+}
+
+
+bool Conn::inGroup(const uint8_t *mac, time_t now)
+{
+    if (! group_table) return false;
+    
+    for (uint8_t i=0; i<group_table_size; i++)
+    {
+	if ( (group_table[i].expire >= now) &&
+	     (memcmp(group_table[i].mac, mac, 6)==0) )
+	    return true;
+    }
+    
+    return false;
+}
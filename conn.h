@@ -5,11 +5,61 @@
 #include <stdint.h>
 #include <time.h>
 
+#include "prio.h"
+#include "bucket.h"
+
 
 class Conn;
+struct handover_io;
+struct pollfd;
+struct suite;
 
 
 typedef bool (*pktHandler)(Conn *src, const uint8_t *data, uint16_t size);
+typedef bool (*ctlHandler)(Conn *src, uint8_t type, const uint8_t *data, uint16_t size);
+
+
+// Control messages (sent encrypted only to peers with ext flag)
+#define CTL_SESSION	1	// server->client: session id, 16 bytes
+#define CTL_RESUME	2	// client->server: resume session, 16 bytes
+#define CTL_PEER	3	// server<->server: server id, 8 bytes
+#define CTL_MAC_ADD	4	// server<->server: MACs behind sender, 6 bytes each
+#define CTL_MAC_DEL	5	// server<->server: MACs gone from sender, 6 bytes each
+#define CTL_CAPS	6	// codec suites sender has (bits), 1 byte
+#define CTL_SWITCH	7	// sender's next frames use this suite, 1 byte
+#define CTL_SHORTCUT	8	// client->server: client can make direct links, no data
+#define CTL_SC_LISTEN	9	// server->client: accept direct link, id 8 + secret 16 + MACs 6 each
+#define CTL_SC_PORT	10	// client->server: listening on it, id 8 + addr 4 + port 2
+#define CTL_SC_CONNECT	11	// server->client: make direct link, id 8 + secret 16 + addr 4 + port 2 + MACs 6 each
+#define CTL_SC_AUTH	12	// client<->client: first message of direct link, id 8 + secret 16
+#define CTL_PING	13	// echo request, sender's timestamp 8 bytes
+#define CTL_PONG	14	// echo reply, timestamp of request 8 bytes
+
+// Local events (given to ctlHandler, never sent)
+#define CTL_LOCAL	0x80
+#define CTL_READY	0x80	// handshake finished, no data
+#define CTL_LEARN	0x81	// new MAC learned, 6 bytes
+#define CTL_TENANT	0x82	// tenant is found by peer's first frame, no data
+
+// MAC tables up to this size are kept inside Conn
+#define MAC_INLINE	8
+
+// Directions stopped by rate limits
+#define THROTTLE_IN	1
+#define THROTTLE_OUT	2
+
+
+// Fields which server's scans read: kept in conntab next to connection's poll entry
+// while it's in server's table, inside Conn otherwise
+struct conn_state
+{
+    time_t timeout_t, keepalive_t;
+    time_t ping_t;	// next ping
+    int outq_size;
+    bool fin;
+    bool congested;	// queue is too long, frames from local netif are dropped for it
+    uint8_t throttled;	// THROTTLE_* bits
+};
 
 
 class Conn
@@ -23,45 +73,90 @@ public:
     bool needWrite();
     void doWrite();
     bool needClose();
+    bool pressure();
+    void unthrottle();
     
     bool handlePkt();
     bool sendRaw(const uint8_t *data, uint16_t len);
-    bool send(const uint8_t *data, uint16_t len);
+    bool send(const uint8_t *data, uint16_t len, uint8_t *pkt=0);	// pkt: pool buffer of data (queued without copy)
+    bool sendCtl(uint8_t type, const uint8_t *data, uint16_t len);
     
-    void addMAC(const uint8_t *mac);
+    bool addMAC(const uint8_t *mac);
     bool findMAC(const uint8_t *mac);
+    void delMAC(const uint8_t *mac);
+    
+    void joinGroup(const uint8_t *mac, time_t expire);
+    void leaveGroup(const uint8_t *mac, time_t expire);
+    bool inGroup(const uint8_t *mac, time_t now);
+    
+    void detach();
+    void adopt(Conn *old);
+    
+    // Handing connection over to new process
+    uint8_t* save(uint32_t *len);
+    static Conn* load(int sock, pktHandler handler, const uint8_t *data, uint32_t len);
     
     
+    // Fields are ordered to keep Conn small (there can be 100k of idle ones)
     Conn *next;
     int sock;
+    uint32_t addr;	// peer address (network order)
+    uint16_t port;
+    
+    struct conn_state *st;	// own_st or entry in server's table
+    struct conn_state own_st;
+    
+    bool ext;	// peer understands control messages
+    bool peer;	// it's a link to another server
+    bool outgoing;	// we've made this connection
+    bool shortcuts;	// client can make direct links to other clients
+    
+    uint8_t keepalive_period;
+    uint8_t keepalive_timeout;
+    bool keepalive_answer;
+    uint8_t ping_period;	// sec between pings of peer which echoes them (0 - it hasn't yet)
+    uint8_t dead_time;	// sec of silence after which such peer is dead (0 - keepalive_timeout)
     
+    // Packet buffers are taken from pool only while packet is in flight
+    // (decoded data of received frame starts at buf+POOL_DATA)
     struct
     {
 	uint8_t *buf;
-	uint8_t state;
 	uint16_t pos, len;
+	uint8_t state;
     } rd;
     
     struct
     {
 	uint16_t pos;
+	uint8_t band;	// band of packet being written
+	bool switching;	// CTL_SWITCH is in top band (lower bands mustn't overtake it)
     } wr;
+    uint16_t mac_table_len;
+    uint16_t tenant;	// index in server's tenants (TENANT_* until peer's key is known)
+    uint8_t outq_skip[PRIO_BANDS];	// packets of upper bands sent while band was waiting
     
+    // Send queue is split into strict priority bands
     struct outq
     {
-	uint8_t *buf;
-	uint16_t len;
-	
+	uint8_t *buf;	// pool buffer (element holds a reference)
 	struct outq *next;
-    } *outq, **outq_tail;
-    int outq_size;
+	const struct suite *suite;	// codec to encrypt data at buf+POOL_DATA (0 - buf is frame ready to send)
+	uint16_t len;
+	uint16_t flags;
+    } *outq[PRIO_BANDS], **outq_tail[PRIO_BANDS];
+    time_t write_t;	// last successful write
+    time_t rx_t;	// last received frame
     
-    bool fin;
+    // Round trip of pings (usec, 0 - no echo yet), rtt_var is jitter, rtt-rtt_min is queueing delay
+    uint32_t rtt, rtt_var, rtt_min;
     
     pktHandler handler;
+    ctlHandler ctl;
     
     uint8_t writeKey[16];
-    uint8_t *readKey;
+    uint8_t *readKey;	// points to read_key when it's known
+    const struct suite *rsuite, *wsuite;	// codecs of frames (picked at handshake)
     
     struct mac_table
     {
@@ -70,10 +165,48 @@ public:
     } *mac_table;
     static int mac_table_size;
     
-    uint8_t keepalive_period;
-    uint8_t keepalive_timeout;
-    bool keepalive_answer;
-    time_t timeout_t, keepalive_t;
+    struct group_table
+    {
+	uint8_t mac[6];
+	time_t expire;
+    } *group_table;
+    static int group_table_size;
+    
+    uint64_t peer_id;
+    uint8_t session[16];
+    
+    uint32_t rx_pkts, tx_pkts;
+    uint64_t rx_bytes, tx_bytes;
+    struct bucket in_bucket, out_bucket;	// rate limits of client connections
+    
+    struct pollfd *pfd;	// entry in server's poll list (0 - not in list)
+    static int throttled_num;	// for calling unthrottle() only when somebody is throttled
+    static int handshakes_num;	// connections which haven't sent their seed yet
+    static int queue_size;	// max bytes in send queue
+
+private:
+    uint8_t read_key[16];
+    struct mac_table mac_inline[MAC_INLINE];
+    
+    bool newMACs();
+    int findTenant();
+    bool gotKey(const uint8_t *key);
+    bool extReady();
+    void ping();
+    void rttSample(uint32_t us);
+    bool tcpAlive();
+    void throttle(uint8_t dir);
+    bool limited(uint8_t dir);
+    void closeSock();
+    
+    Conn() {}
+    void handover(struct handover_io *s);
+    
+    bool sendEnc(const uint8_t *data, uint16_t len, uint16_t flags, uint8_t band, uint8_t *pkt);
+    void enqueue(struct outq *q, uint8_t band);
+    uint8_t nextBand();
+    void mergeQueue();
+    void dropQueue();
 };
 
 
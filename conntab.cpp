@@ -0,0 +1,113 @@
+#include "conntab.h"
+
+#include <string.h>
+
+#include "conn.h"
+#include "tenant.h"
+#include "debug.h"
+
+
+Conn **conns=0;
+struct pollfd *conn_pfd=0;
+struct conn_state *conn_st=0;
+int conns_num=0;
+int pfd_taps=0;
+
+static int conns_max=0;
+
+
+static bool grow()
+{
+    int max=(conns_max > 0) ? conns_max*2 : 64;
+    
+    Conn **c=new Conn*[max];
+    struct pollfd *p=new struct pollfd[PFD_CONN+max];
+    struct conn_state *st=new struct conn_state[max];
+    if ( (! c) || (! p) || (! st) )
+    {
+	if (c) delete[] c;
+	if (p) delete[] p;
+	if (st) delete[] st;
+	return false;
+    }
+    
+    if (conns)
+    {
+	memcpy(c, conns, sizeof(Conn*)*conns_num);
+	memcpy(p, conn_pfd, sizeof(struct pollfd)*(PFD_CONN+conns_num));
+	memcpy(st, conn_st, sizeof(struct conn_state)*conns_num);
+	delete[] conns;
+	delete[] conn_pfd;
+	delete[] conn_st;
+    } else
+    {
+	for (int i=0; i<PFD_CONN; i++)
+	{
+	    p[i].fd=-1;
+	    p[i].events=POLLIN;
+	    p[i].revents=0;
+	}
+    }
+    
+    conns=c;
+    conn_pfd=p;
+    conn_st=st;
+    conns_max=max;
+    
+    // Connections point to their poll entries & states
+    for (int i=0; i<conns_num; i++)
+    {
+	conns[i]->pfd=&conn_pfd[PFD_CONN+i];
+	conns[i]->st=&conn_st[i];
+    }
+    
+    return true;
+}
+
+
+bool conntab_init(int taps)
+{
+    if (conn_pfd) return true;
+    pfd_taps=taps;
+    return grow();
+}
+
+
+bool conntab_add(Conn *c)
+{
+    if ( (conns_num >= conns_max) && (! grow()) ) return false;
+    if ( (c->tenant < tenants_num) && (! tenant_join(c)) ) return false;
+    
+    struct pollfd *p=&conn_pfd[PFD_CONN+conns_num];
+    p->fd=(c->st->fin) ? -1 : c->sock;
+    p->events=POLLIN | ((c->st->outq_size > 0) ? POLLOUT : 0);
+    p->revents=0;
+    
+    // State moves into the table
+    conn_st[conns_num]=*c->st;
+    c->st=&conn_st[conns_num];
+    
+    conns[conns_num++]=c;
+    c->pfd=p;
+    return true;
+}
+
+
+void conntab_del(int i)
+{
+    tenant_leave(conns[i]);
+    conns[i]->pfd=0;
+    conns[i]->own_st=conn_st[i];	// state goes back into connection
+    conns[i]->st=&conns[i]->own_st;
+    
+    // Moving last connection to this place
+    conns_num--;
+    if (i < conns_num)
+    {
+	conns[i]=conns[conns_num];
+	conn_pfd[PFD_CONN+i]=conn_pfd[PFD_CONN+conns_num];
+	conn_st[i]=conn_st[conns_num];
+	conns[i]->pfd=&conn_pfd[PFD_CONN+i];
+	conns[i]->st=&conn_st[i];
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef CONNTAB_H
+#define CONNTAB_H
+
+
+#include <stdint.h>
+#include <poll.h>
+
+
+class Conn;
+struct conn_state;
+
+
+// Service sockets at the beginning of poll list (fd is -1 if not used)
+#define PFD_SRV		0	// listening socket
+#define PFD_HANDOVER	1	// handover socket
+#define PFD_TAP		2
+#define PFD_BRIDGE	3
+#define PFD_TENANT	4	// TAPs of tenants 1, 2... (as many as conntab_init() is told)
+#define PFD_CONN	(PFD_TENANT+pfd_taps)	// connection sockets start here
+
+
+// Dense table of server connections: conns[i] owns conn_pfd[PFD_CONN+i] and conn_st[i]
+// (scans are linear over contiguous memory, idle connections are only touched by poll
+// and by checks of their state)
+extern Conn **conns;
+extern struct pollfd *conn_pfd;
+extern struct conn_state *conn_st;
+extern int conns_num;
+extern int pfd_taps;
+
+
+bool conntab_init(int taps=0);
+bool conntab_add(Conn *c);	// connection of known tenant joins it
+void conntab_del(int i);	// last connection takes place of removed one
+
+
+#endif
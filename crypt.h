@@ -3,6 +3,7 @@
 
 
 #include <stdint.h>
+#include <string.h>
 
 
 // 128-bit key
@@ -10,19 +11,90 @@ extern uint8_t key128[16];
 
 
 // Hash-function to make 128-bit key from password
-void makeKey128(const char *key_str);
+void makeKey128(const char *key_str, uint8_t *key=key128);
 
 // Get 128-bit random
 void rand128(uint8_t *buf);
 
+// Calc CRC16 for data
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t size);
+
+
+// Cipher is inline, so codecs get it inlined into their loops
+// https://en.wikipedia.org/wiki/XTEA
+static inline void xtea_encipher(unsigned int num_rounds, uint32_t *v, uint32_t const *k) {
+    unsigned int i;
+    uint32_t v0=v[0], v1=v[1], sum=0, delta=0x9E3779B9;
+    for (i=0; i < num_rounds; i++) {
+	v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + k[sum & 3]);
+	sum += delta;
+	v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + k[(sum>>11) & 3]);
+    }
+    v[0]=v0; v[1]=v1;
+}
+
+static inline void xtea_decipher(unsigned int num_rounds, uint32_t *v, uint32_t const *k) {
+    unsigned int i;
+    uint32_t v0=v[0], v1=v[1], delta=0x9E3779B9, sum=delta*num_rounds;
+    for (i=0; i < num_rounds; i++) {
+	v1 -= (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + k[(sum>>11) & 3]);
+	sum -= delta;
+	v0 -= (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + k[sum & 3]);
+    }
+    v[0]=v0; v[1]=v1;
+}
+
+
 // Encrypt 128-bit data with 128-bit key
-void encrypt128(uint8_t *buf, const uint8_t *key);
+static inline void encrypt128(uint8_t *buf, const uint8_t *key)
+{
+#ifdef UNALIGNED_32BIT
+    xtea_encipher(32, (uint32_t*)(buf+0), (const uint32_t*)key);
+    xtea_encipher(32, (uint32_t*)(buf+8), (const uint32_t*)key);
+#else
+    // Checking buffer alignment
+    if (! (((uint64_t)buf) & 3))
+    {
+	// Well-aligned
+	xtea_encipher(32, (uint32_t*)(buf+0), (const uint32_t*)key);
+	xtea_encipher(32, (uint32_t*)(buf+8), (const uint32_t*)key);
+    } else
+    {
+	// Use temp buffer
+	uint32_t tmp[4];
+	memcpy(tmp, buf, 16);
+	xtea_encipher(32, tmp+0, (const uint32_t*)key);
+	xtea_encipher(32, tmp+2, (const uint32_t*)key);
+	memcpy(buf, tmp, 16);
+    }
+#endif
+}
 
-// Decrypt 128-bit data using 128-bit key
-void decrypt128(uint8_t *buf, const uint8_t *key);
 
-// Calc CRC16 for data
-uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t size);
+// Decrypt 128-bit data using 128-bit key
+static inline void decrypt128(uint8_t *buf, const uint8_t *key)
+{
+#ifdef UNALIGNED_32BIT
+    xtea_decipher(32, (uint32_t*)(buf+0), (const uint32_t*)key);
+    xtea_decipher(32, (uint32_t*)(buf+8), (const uint32_t*)key);
+#else
+    // Checking buffer alignment
+    if (! (((uint64_t)buf) & 3))
+    {
+	// Well-aligned
+	xtea_decipher(32, (uint32_t*)(buf+0), (const uint32_t*)key);
+	xtea_decipher(32, (uint32_t*)(buf+8), (const uint32_t*)key);
+    } else
+    {
+	// Use temp buffer
+	uint32_t tmp[4];
+	memcpy(tmp, buf, 16);
+	xtea_decipher(32, tmp+0, (const uint32_t*)key);
+	xtea_decipher(32, tmp+2, (const uint32_t*)key);
+	memcpy(buf, tmp, 16);
+    }
+#endif
+}
 
 
 
@@ -0,0 +1,24 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+
+#include <stdint.h>
+
+
+// Adding data to internet checksum (returns folded 16-bit sum, not inverted)
+static inline uint16_t csum_add(uint32_t sum, const uint8_t *data, uint16_t len)
+{
+    while (len > 1)
+    {
+	sum+=(data[0] << 8) | data[1];
+	data+=2;
+	len-=2;
+    }
+    if (len) sum+=data[0] << 8;
+    while (sum >> 16)
+	sum=(sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+
+#endif
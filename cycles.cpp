@@ -0,0 +1,100 @@
+#include "cycles.h"
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+
+struct cycles_stage cycles_stages[CYC_STAGES];
+
+static FILE *report_file=0;	// kept open (daemon changes its directory)
+static volatile int report_asked=0;
+
+static const char *names[CYC_STAGES]={ "read", "decode", "learn", "route", "send", "encode", "write" };
+
+
+static void ask(int)
+{
+    report_asked=1;
+}
+
+
+bool cycles_open(const char *file)
+{
+#ifndef CYCLES
+    fprintf(stderr, "Error: tinytun is built without cycle accounting (see CYCLES in Makefile)\n");
+    return false;
+#endif
+
+    report_file=fopen(file, "w");
+    if (! report_file)
+    {
+	perror(file);
+	return false;
+    }
+    
+    signal(SIGUSR2, ask);
+    return true;
+}
+
+
+void cycles_check()
+{
+    if (! report_asked) return;
+    report_asked=0;
+    
+    // Report replaces previous one
+    rewind(report_file);
+    if (ftruncate(fileno(report_file), 0) != 0) DEBUG("Error: can't truncate cycles report\n");
+    cycles_report(report_file, cycles_stages);
+    fflush(report_file);
+    
+    // Next report shows time since this one
+    memset(cycles_stages, 0, sizeof(cycles_stages));
+}
+
+
+// Upper bound of bucket where p-th part of calls is reached
+static uint64_t percentile(const struct cycles_stage *s, double p)
+{
+    uint64_t want=(uint64_t)(s->calls*p), n=0;
+    for (int b=0; b<CYC_BUCKETS; b++)
+    {
+	n+=s->hist[b];
+	if (n > want) return 1ULL << b;
+    }
+    return 1ULL << (CYC_BUCKETS-1);
+}
+
+
+void cycles_report(FILE *f, const struct cycles_stage *st)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    fprintf(f, "Stage        calls   cycles/call      p50      p99  (route includes send)\n");
+#else
+    fprintf(f, "Stage        calls       ns/call      p50      p99  (route includes send)\n");
+#endif
+    for (int i=0; i<CYC_STAGES; i++)
+    {
+	const struct cycles_stage *s=&st[i];
+	if (s->calls == 0) continue;
+	fprintf(f, "  %-8s %9llu %13.0f %8llu %8llu\n", names[i], (unsigned long long)s->calls,
+		(double)s->total/s->calls,
+		(unsigned long long)percentile(s, 0.5), (unsigned long long)percentile(s, 0.99));
+    }
+    
+    // Histograms (bucket is named by its upper bound)
+    for (int i=0; i<CYC_STAGES; i++)
+    {
+	const struct cycles_stage *s=&st[i];
+	if (s->calls == 0) continue;
+	fprintf(f, "%s:\n", names[i]);
+	for (int b=0; b<CYC_BUCKETS; b++)
+	{
+	    if (s->hist[b] == 0) continue;
+	    fprintf(f, "  <%-10llu %9llu  %5.1f%%\n", 1ULL << b, (unsigned long long)s->hist[b], 100.0*s->hist[b]/s->calls);
+	}
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef CYCLES_H
+#define CYCLES_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef CYCLES
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+
+// Stages of data path (CPU cycles spent in them are counted in builds with -DCYCLES)
+enum
+{
+    CYC_READ,	// read() of connection's socket
+    CYC_DECODE,	// decrypting and checking received frame
+    CYC_LEARN,	// learning its src MAC
+    CYC_ROUTE,	// handler of received frame: route() with its sends on server, TAP write on client
+    CYC_SEND,	// queueing frame to connection
+    CYC_ENCODE,	// encrypting batch of queued frames
+    CYC_WRITE,	// write() of batch
+    CYC_STAGES
+};
+
+// Histogram buckets: <2, <4, <8 ... cycles
+#define CYC_BUCKETS	32
+
+struct cycles_stage
+{
+    uint64_t calls, total;
+    uint64_t hist[CYC_BUCKETS];
+};
+
+extern struct cycles_stage cycles_stages[CYC_STAGES];
+
+
+// Writing report to file on SIGUSR2 (counters start again then)
+bool cycles_open(const char *file);
+
+// Writing report if SIGUSR2 has come (called by event loops)
+void cycles_check();
+
+// Report of stages (cycles/call, percentiles, histogram)
+void cycles_report(FILE *f, const struct cycles_stage *st);
+
+
+#ifdef CYCLES
+
+static inline uint64_t cycles_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;	// nanoseconds then
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+static inline void cycles_add(int stage, uint64_t c)
+{
+    struct cycles_stage *s=&cycles_stages[stage];
+    int b=64-__builtin_clzll(c | 1);
+    s->calls++;
+    s->total+=c;
+    s->hist[(b < CYC_BUCKETS) ? b : CYC_BUCKETS-1]++;
+}
+
+#define CYCLES_START(t)		uint64_t t=cycles_now()
+#define CYCLES_END(stage, t)	cycles_add(stage, cycles_now()-(t))
+
+#else
+
+#define CYCLES_START(t)
+#define CYCLES_END(stage, t)
+
+#endif
+
+
+#endif
@@ -0,0 +1,207 @@
+#include "handover.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "debug.h"
+
+
+// Maximum message size (connection with full queue)
+#define MAX_MSG_SIZE	(1024*1024)
+
+
+static bool make_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family=AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+	fprintf(stderr, "Error: handover socket path is too long\n");
+	return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+
+// Other side runs as our user or root (anybody else could take our clients or give us fake ones)
+static bool trusted(int us)
+{
+    struct ucred cred;
+    socklen_t l=sizeof(cred);
+    if (getsockopt(us, SOL_SOCKET, SO_PEERCRED, &cred, &l) != 0) return false;
+    return (cred.uid == geteuid()) || (cred.uid == 0);
+}
+
+
+int handover_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (! make_addr(path, &addr)) return -1;
+    
+    int us=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (us < 0)
+    {
+	perror("socket");
+	return -1;
+    }
+    
+    // Only our user can connect to socket file
+    unlink(path);
+    mode_t mask=umask(0077);
+    int r=bind(us, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if ( (r != 0) || (listen(us, 1) != 0) )
+    {
+	perror(path);
+	close(us);
+	return -1;
+    }
+    
+    return us;
+}
+
+
+int handover_accept(int hl)
+{
+    int hs=accept(hl, 0, 0);
+    if (hs < 0) return -1;
+    
+    if (! trusted(hs))
+    {
+	DEBUG("Handover: process of other user refused\n");
+	close(hs);
+	return -1;
+    }
+    return hs;
+}
+
+
+int handover_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    if (! make_addr(path, &addr)) return -1;
+    
+    int us=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (us < 0) return -1;
+    
+    if (connect(us, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+	// Nobody is running
+	close(us);
+	return -1;
+    }
+    
+    if (! trusted(us))
+    {
+	fprintf(stderr, "Error: handover socket %s belongs to other user\n", path);
+	close(us);
+	return -1;
+    }
+    
+    // Not waiting forever for hung process
+    struct timeval tv={ 5, 0 };
+    setsockopt(us, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(us, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return us;
+}
+
+
+bool handover_send(int us, int fd, const uint8_t *data, uint32_t len)
+{
+    // Length goes with descriptor
+    struct iovec iov={ &len, sizeof(len) };
+    union
+    {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    
+    if (fd >= 0)
+    {
+	memset(&cmsg, 0, sizeof(cmsg));
+	msg.msg_control=cmsg.buf;
+	msg.msg_controllen=sizeof(cmsg.buf);
+	struct cmsghdr *c=CMSG_FIRSTHDR(&msg);
+	c->cmsg_level=SOL_SOCKET;
+	c->cmsg_type=SCM_RIGHTS;
+	c->cmsg_len=CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    
+    if (sendmsg(us, &msg, MSG_NOSIGNAL) != sizeof(len)) return false;
+    
+    // Data
+    while (len > 0)
+    {
+	int l=send(us, data, len, MSG_NOSIGNAL);
+	if (l <= 0)
+	{
+	    if ( (l < 0) && (errno == EINTR) ) continue;
+	    return false;
+	}
+	data+=l;
+	len-=l;
+    }
+    
+    return true;
+}
+
+
+uint8_t* handover_recv(int us, int *fd, uint32_t *len)
+{
+    struct iovec iov={ len, sizeof(*len) };
+    union
+    {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=cmsg.buf;
+    msg.msg_controllen=sizeof(cmsg.buf);
+    
+    (*fd)=-1;
+    if (recvmsg(us, &msg, MSG_WAITALL) != sizeof(*len)) return 0;
+    
+    struct cmsghdr *c=CMSG_FIRSTHDR(&msg);
+    if ( (c) && (c->cmsg_level == SOL_SOCKET) && (c->cmsg_type == SCM_RIGHTS) )
+	memcpy(fd, CMSG_DATA(c), sizeof(int));
+    
+    if ( ((*len) > MAX_MSG_SIZE) || (msg.msg_flags & MSG_CTRUNC) )
+    {
+	DEBUG("Handover: bad message\n");
+	if ((*fd) >= 0) close(*fd);
+	return 0;
+    }
+    
+    // Data
+    uint8_t *data=new uint8_t[(*len) + 1];	// never empty
+    uint32_t pos=0;
+    while (pos < (*len))
+    {
+	int l=recv(us, data+pos, (*len)-pos, MSG_WAITALL);
+	if (l <= 0)
+	{
+	    if ( (l < 0) && (errno == EINTR) ) continue;
+	    if ((*fd) >= 0) close(*fd);
+	    delete[] data;
+	    return 0;
+	}
+	pos+=l;
+    }
+    
+    return data;
+}
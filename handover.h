@@ -0,0 +1,55 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+
+#include <stdint.h>
+#include <string.h>
+
+
+// Format of handed over state (both processes must have the same)
+#define HANDOVER_VERSION	5
+
+
+// Listen for new process on UNIX socket (old socket file is replaced)
+int handover_listen(const char *path);
+
+// Accept new process (-1 if it's of other user than ours and not root)
+int handover_accept(int hl);
+
+// Connect to running process (-1 if nobody is there or it's of other user)
+int handover_connect(const char *path);
+
+// Send message with optional descriptor (fd < 0 - none)
+bool handover_send(int us, int fd, const uint8_t *data, uint32_t len);
+
+// Receive message (fd is -1 if there was none), buffer must be deleted by caller
+uint8_t* handover_recv(int us, int *fd, uint32_t *len);
+
+
+// Serializing state field by field (same code saves and loads, so order is always the same)
+struct handover_io
+{
+    uint8_t *out;	// saving (0 - just counting size)
+    const uint8_t *in;	// loading
+    uint32_t pos, len;
+    bool ok;
+    
+    void io(void *data, uint32_t n)
+    {
+	if (in)
+	{
+	    if ( (! ok) || (n > len-pos) )
+	    {
+		ok=false;
+		memset(data, 0, n);
+		return;
+	    }
+	    memcpy(data, in+pos, n);
+	} else
+	if (out) memcpy(out+pos, data, n);
+	pos+=n;
+    }
+};
+
+
+#endif
@@ -0,0 +1,62 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "debug.h"
+
+
+
+bool latency_mode=false;
+int latency_cpu=-1;
+int latency_spin=200;
+
+
+void latency_setup()
+{
+    if ( (! latency_mode) || (latency_cpu < 0) ) return;
+    
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(latency_cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+	DEBUG("Warning: can't pin to CPU %d\n", latency_cpu);
+    }
+}
+
+
+void latency_socket(int sock)
+{
+    if (! latency_mode) return;
+    
+    // Driver is polled by socket reads (needs CAP_NET_ADMIN, ignored otherwise)
+    int value=latency_spin;
+    setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+    
+    value=NOTSENT_LOWAT;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof(value)))
+    {
+	DEBUG("Warning: can't set TCP_NOTSENT_LOWAT option\n");
+    }
+}
+
+
+int latency_timeout(int events)
+{
+    static struct timespec last;
+    
+    if (! latency_mode) return 1000;
+    
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (events > 0) last=now;
+    
+    // Spinning while budget lasts, sleeping then
+    long us=(now.tv_sec - last.tv_sec)*1000000L + (now.tv_nsec - last.tv_nsec)/1000;
+    return (us < latency_spin) ? 0 : 1000;
+}
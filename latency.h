@@ -0,0 +1,27 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+
+// Low-latency mode: CPU to pin to (-1 - any), off if latency_mode is false
+extern bool latency_mode;
+extern int latency_cpu;
+extern int latency_spin;	// usec of busy polling after last event
+
+// Send queue size in low-latency mode (packets wait there instead of socket buffer)
+#define LATENCY_Q_SIZE	32768
+
+// Unsent bytes kernel keeps (the rest waits in our queue where it can be reordered)
+#define NOTSENT_LOWAT	16384
+
+
+// Pinning process (after daemonizing)
+void latency_setup();
+
+// Socket options: busy polling, keeping unsent data in our queue
+void latency_socket(int sock);
+
+// Timeout for poll/select (ms): 0 while spin budget lasts after last event
+int latency_timeout(int events);
+
+
+#endif
@@ -0,0 +1,213 @@
+#include "mcast.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "conn.h"
+#include "debug.h"
+
+
+// Ethernet types
+#define ETH_IPV4	0x0800
+#define ETH_IPV6	0x86DD
+
+// IGMP message types
+#define IGMP_V1_REPORT	0x12
+#define IGMP_V2_REPORT	0x16
+#define IGMP_V2_LEAVE	0x17
+#define IGMP_V3_REPORT	0x22
+
+// MLD message types
+#define MLD_V1_REPORT	131
+#define MLD_V1_DONE	132
+#define MLD_V2_REPORT	143
+
+// Group record types (IGMPv3/MLDv2)
+#define MODE_IS_INCLUDE	1
+#define CHANGE_TO_INCLUDE 3
+#define BLOCK_OLD	6
+
+// Time for other hosts behind connection to report group after leave
+#define LEAVE_TIME	2
+
+
+int mcast_timeout=0;
+bool mcast_flood_unknown=true;
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static void mac4(uint8_t *mac, const uint8_t *ip)
+{
+    mac[0]=0x01;
+    mac[1]=0x00;
+    mac[2]=0x5e;
+    mac[3]=ip[1] & 0x7f;
+    mac[4]=ip[2];
+    mac[5]=ip[3];
+}
+
+
+static void mac6(uint8_t *mac, const uint8_t *ip)
+{
+    mac[0]=0x33;
+    mac[1]=0x33;
+    memcpy(mac+2, ip+12, 4);
+}
+
+
+static void update(Conn *src, const uint8_t *mac, bool join)
+{
+    if (! mcast_snooped(mac)) return;
+    
+    DEBUG("mcast: %s %02x:%02x:%02x:%02x:%02x:%02x\n", join ? "join" : "leave",
+	mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    
+    time_t now=time(NULL);
+    if (join)
+	src->joinGroup(mac, now + mcast_timeout); else
+	src->leaveGroup(mac, now + LEAVE_TIME);
+}
+
+
+// IGMPv3/MLDv2 group record
+static void record(Conn *src, const uint8_t *mac, uint8_t type, uint16_t nsrc)
+{
+    // Include nothing means leave
+    if ( ((type == MODE_IS_INCLUDE) || (type == CHANGE_TO_INCLUDE)) && (nsrc == 0) )
+	update(src, mac, false); else
+    if (type != BLOCK_OLD)
+	update(src, mac, true);
+}
+
+
+static void igmp(Conn *src, const uint8_t *p, uint16_t len)
+{
+    uint8_t mac[6];
+    
+    if (len < 8) return;
+    switch (p[0])
+    {
+	case IGMP_V1_REPORT:
+	case IGMP_V2_REPORT:
+	case IGMP_V2_LEAVE:
+	    mac4(mac, p+4);
+	    update(src, mac, p[0] != IGMP_V2_LEAVE);
+	    break;
+	
+	case IGMP_V3_REPORT:
+	    {
+		uint16_t n=get16(p+6);
+		uint16_t offs=8;
+		while ( (n--) && (offs+8 <= len) )
+		{
+		    uint16_t nsrc=get16(p+offs+2);
+		    mac4(mac, p+offs+4);
+		    record(src, mac, p[offs], nsrc);
+		    offs+=8 + nsrc*4 + p[offs+1]*4;
+		}
+	    }
+	    break;
+    }
+}
+
+
+static void mld(Conn *src, const uint8_t *p, uint16_t len)
+{
+    uint8_t mac[6];
+    
+    if (len < 8) return;
+    switch (p[0])
+    {
+	case MLD_V1_REPORT:
+	case MLD_V1_DONE:
+	    if (len < 24) return;
+	    mac6(mac, p+8);
+	    update(src, mac, p[0] == MLD_V1_REPORT);
+	    break;
+	
+	case MLD_V2_REPORT:
+	    {
+		uint16_t n=get16(p+6);
+		uint16_t offs=8;
+		while ( (n--) && (offs+20 <= len) )
+		{
+		    uint16_t nsrc=get16(p+offs+2);
+		    mac6(mac, p+offs+4);
+		    record(src, mac, p[offs], nsrc);
+		    offs+=20 + nsrc*16 + p[offs+1]*4;
+		}
+	    }
+	    break;
+    }
+}
+
+
+void mcast_snoop(Conn *src, const uint8_t *data, uint16_t len)
+{
+    uint16_t type=get16(data+12);
+    
+    if (type == ETH_IPV4)
+    {
+	const uint8_t *ip=data+14;
+	if ( (len < 14+20) || ((ip[0] >> 4) != 4) || (ip[9] != 2) ) return;	// not IGMP
+	
+	uint16_t hl=(ip[0] & 15)*4;
+	uint16_t tl=get16(ip+2);
+	if ( (hl < 20) || (tl < hl) || (tl > len-14) ) return;
+	
+	igmp(src, ip+hl, tl-hl);
+    } else
+    if (type == ETH_IPV6)
+    {
+	const uint8_t *ip=data+14;
+	if ( (len < 14+40) || ((ip[0] >> 4) != 6) ) return;
+	
+	uint16_t pl=get16(ip+4);
+	if (pl > len-14-40) return;
+	
+	// Skipping extension headers (MLD has hop-by-hop router alert)
+	uint8_t next=ip[6];
+	const uint8_t *p=ip+40;
+	while ( (next == 0) || (next == 43) || (next == 60) )
+	{
+	    if (pl < 8) return;
+	    uint16_t l=(p[1]+1)*8;
+	    if (l > pl) return;
+	    next=p[0];
+	    p+=l;
+	    pl-=l;
+	}
+	
+	if (next == 58) mld(src, p, pl);	// ICMPv6
+    }
+}
+
+
+bool mcast_snooped(const uint8_t *mac)
+{
+    if ( (mac[0] == 0x01) && (mac[1] == 0x00) && (mac[2] == 0x5e) )
+    {
+	// IPv4: 224.0.0.x is never reported (and it's aliased by x.0.0.x and x.128.0.x)
+	return (mac[3] != 0) || (mac[4] != 0);
+    }
+    
+    if ( (mac[0] == 0x33) && (mac[1] == 0x33) )
+    {
+	// IPv6: solicited-node groups (neighbor discovery must always work)
+	if (mac[2] == 0xff) return false;
+	
+	// All-nodes, all-routers and MLDv2 reports
+	if ( (mac[2] == 0) && (mac[3] == 0) && (mac[4] == 0) &&
+	     ((mac[5] == 0x01) || (mac[5] == 0x02) || (mac[5] == 0x16)) ) return false;
+	
+	return true;
+    }
+    
+    // Other multicast
+    return false;
+}
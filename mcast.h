@@ -0,0 +1,25 @@
+#ifndef MCAST_H
+#define MCAST_H
+
+
+#include <stdint.h>
+
+
+class Conn;
+
+
+// Multicast membership timeout in sec (0 - snooping disabled)
+extern int mcast_timeout;
+
+// Send multicast for groups without members to everybody
+extern bool mcast_flood_unknown;
+
+
+// Remember groups from IGMP/MLD reports sent by src
+void mcast_snoop(Conn *src, const uint8_t *data, uint16_t len);
+
+// Checking if multicast MAC is routed by membership (not reserved for link-local control)
+bool mcast_snooped(const uint8_t *mac);
+
+
+#endif
@@ -0,0 +1,179 @@
+#include "mss.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include "debug.h"
+
+
+// Ethernet types
+#define ETH_VLAN	0x8100
+#define ETH_QINQ	0x88A8
+#define ETH_IPV4	0x0800
+#define ETH_IPV6	0x86DD
+
+#define TCP_SYN		0x02
+#define TCPOPT_EOL	0
+#define TCPOPT_NOP	1
+#define TCPOPT_MSS	2
+
+// Headers below TCP payload for MTU->MSS
+#define IPV4_TCP_HDRS	40
+#define IPV6_EXTRA	20
+
+
+int mss_max=0;
+bool mss_auto=false;
+
+static char netif[IFNAMSIZ];
+static time_t netif_t=0;
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    p[0]=v >> 8;
+    p[1]=v & 0xff;
+}
+
+
+bool mss_parse(const char *str)
+{
+    if (strcmp(str, "auto") == 0)
+    {
+	mss_auto=true;
+	return true;
+    }
+    
+    char *end;
+    mss_max=strtol(str, &end, 10);
+    if ( (*end != 0) || (mss_max < 500) || (mss_max > 9000) )
+    {
+	fprintf(stderr, "Error: incorrect MSS (500..9000 or auto)\n");
+	return false;
+    }
+    return true;
+}
+
+
+void mss_netif(const char *dev)
+{
+    if (dev) snprintf(netif, sizeof(netif), "%s", dev);
+}
+
+
+// Reading MTU of local netif (once a second at most)
+static void refresh()
+{
+    time_t now=time(NULL);
+    if ( (! netif[0]) || (now == netif_t) ) return;
+    netif_t=now;
+    
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", netif);
+    
+    int s=socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) return;
+    if (ioctl(s, SIOCGIFMTU, &ifr) == 0) mss_max=ifr.ifr_mtu - IPV4_TCP_HDRS;
+    close(s);
+}
+
+
+// RFC 1624: HC' = ~(~HC + ~m + m')
+static inline uint16_t csum_update(uint16_t sum, uint16_t old_val, uint16_t new_val)
+{
+    uint32_t s=(uint16_t)~sum + (uint16_t)~old_val + new_val;
+    s=(s & 0xffff) + (s >> 16);
+    s=(s & 0xffff) + (s >> 16);
+    return ~s;
+}
+
+
+static void clamp_tcp(uint8_t *tcp, uint16_t len, uint16_t mss)
+{
+    if ( (len < 20) || (! (tcp[13] & TCP_SYN)) ) return;
+    
+    uint16_t hlen=(tcp[12] >> 4)*4;
+    if ( (hlen < 20) || (hlen > len) ) return;
+    
+    // Looking for MSS option
+    for (uint16_t i=20; i < hlen; )
+    {
+	uint8_t kind=tcp[i];
+	if (kind == TCPOPT_EOL) return;
+	if (kind == TCPOPT_NOP)
+	{
+	    i++;
+	    continue;
+	}
+	if ( (i+1 >= hlen) || (tcp[i+1] < 2) || (i+tcp[i+1] > hlen) ) return;
+	
+	if ( (kind == TCPOPT_MSS) && (tcp[i+1] == 4) )
+	{
+	    uint16_t old_mss=get16(tcp+i+2);
+	    if (old_mss <= mss) return;
+	    
+	    DEBUG("MSS: %d -> %d\n", old_mss, mss);
+	    put16(tcp+i+2, mss);
+	    
+	    // Checksum is sum of 16-bit words from header start, odd offset swaps bytes
+	    uint16_t o=old_mss, n=mss;
+	    if (i & 1)
+	    {
+		o=(o >> 8) | (o << 8);
+		n=(n >> 8) | (n << 8);
+	    }
+	    put16(tcp+16, csum_update(get16(tcp+16), o, n));
+	    return;
+	}
+	i+=tcp[i+1];
+    }
+}
+
+
+void mss_clamp(uint8_t *data, uint16_t len)
+{
+    if (mss_auto) refresh();
+    if (mss_max <= 0) return;
+    
+    if (len < 14) return;
+    uint16_t type=get16(data+12);
+    uint16_t offs=14;
+    
+    // Skipping VLAN tags
+    while ( ((type == ETH_VLAN) || (type == ETH_QINQ)) && (len >= offs+4) )
+    {
+	type=get16(data+offs+2);
+	offs+=4;
+    }
+    
+    uint8_t *ip=data+offs;
+    len-=offs;
+    
+    if ( (type == ETH_IPV4) && (len >= 20) )
+    {
+	// Only first fragments have TCP header
+	uint16_t hlen=(ip[0] & 0x0f)*4;
+	if ( (ip[9] != IPPROTO_TCP) || (hlen < 20) || (hlen > len) || (get16(ip+6) & 0x1fff) ) return;
+	clamp_tcp(ip+hlen, len-hlen, mss_max);
+    } else
+    if ( (type == ETH_IPV6) && (len >= 40) )
+    {
+	// TCP right after IPv6 header (SYNs have no extension headers in practice)
+	if (ip[6] != IPPROTO_TCP) return;
+	clamp_tcp(ip+40, len-40, mss_max - IPV6_EXTRA);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef MSS_H
+#define MSS_H
+
+
+#include <stdint.h>
+
+
+// MSS of IPv4 TCP (IPv6 gets 20 bytes less), 0 - no clamping
+extern int mss_max;
+
+// Taking MSS from MTU of local netif instead
+extern bool mss_auto;
+
+
+// Setting MSS from "N" or "auto"
+bool mss_parse(const char *str);
+
+// Local netif for auto MSS (its MTU may be changed after start)
+void mss_netif(const char *dev);
+
+// Lowering MSS option of TCP SYN in Ethernet frame (with checksum update)
+void mss_clamp(uint8_t *data, uint16_t len);
+
+
+#endif
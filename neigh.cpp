@@ -0,0 +1,284 @@
+#include "neigh.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "csum.h"
+#include "debug.h"
+
+
+// Cache size (must be power of 2) and number of probes when looking for IP
+#define CACHE_SIZE	1024
+#define CACHE_PROBES	8
+
+// Ethernet types
+#define ETH_ARP		0x0806
+#define ETH_IPV6	0x86DD
+
+// ICMPv6 types
+#define ND_NS		135
+#define ND_NA		136
+
+// ND options
+#define ND_OPT_SLLA	1
+#define ND_OPT_TLLA	2
+
+// NA flags
+#define NA_ROUTER	0x80
+#define NA_SOLICITED	0x40
+#define NA_OVERRIDE	0x20
+
+
+int neigh_timeout=0;
+
+
+static struct neigh
+{
+    uint8_t ip[16];	// IPv4 is stored as ::ffff:a.b.c.d
+    uint8_t mac[6];
+    uint8_t router;	// IPv6 router flag
+    uint16_t tenant;	// tenants share the cache, not their hosts
+    time_t t;		// last seen (0 - empty)
+} cache[CACHE_SIZE];
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+static inline void put16(uint8_t *p, uint16_t v)
+{
+    p[0]=v >> 8;
+    p[1]=v & 0xff;
+}
+
+
+static void mapped(uint8_t *ip, const uint8_t *ip4)
+{
+    memset(ip, 0, 10);
+    ip[10]=0xff;
+    ip[11]=0xff;
+    memcpy(ip+12, ip4, 4);
+}
+
+
+static uint16_t hash(uint16_t tenant, const uint8_t *ip)
+{
+    uint32_t h=2166136261u;	// FNV-1a
+    h=(h ^ (tenant & 0xff)) * 16777619u;
+    h=(h ^ (tenant >> 8)) * 16777619u;
+    for (uint8_t i=0; i<16; i++)
+	h=(h ^ ip[i]) * 16777619u;
+    return h & (CACHE_SIZE-1);
+}
+
+
+static struct neigh* lookup(uint16_t tenant, const uint8_t *ip)
+{
+    uint16_t n=hash(tenant, ip);
+    for (uint8_t i=0; i<CACHE_PROBES; i++)
+    {
+	struct neigh *e=&cache[(n+i) & (CACHE_SIZE-1)];
+	if ( (e->t) && (e->tenant == tenant) && (memcmp(e->ip, ip, 16)==0) ) return e;
+    }
+    return 0;
+}
+
+
+static void learn(uint16_t tenant, const uint8_t *ip, const uint8_t *mac, uint8_t router)
+{
+    // Multicast/broadcast MACs can't be neighbors
+    if (mac[0] & 1) return;
+    
+    time_t now=time(NULL);
+    struct neigh *e=lookup(tenant, ip);
+    if (! e)
+    {
+	// Taking free, expired or oldest slot
+	uint16_t n=hash(tenant, ip);
+	e=&cache[n];
+	for (uint8_t i=0; i<CACHE_PROBES; i++)
+	{
+	    struct neigh *x=&cache[(n+i) & (CACHE_SIZE-1)];
+	    if (x->t < e->t) e=x;
+	    if (x->t + neigh_timeout < now) break;
+	}
+	memcpy(e->ip, ip, 16);
+	e->tenant=tenant;
+    }
+    
+    memcpy(e->mac, mac, 6);
+    e->router=router;
+    e->t=now;
+}
+
+
+// Returns ICMPv6 header of ND packet (or 0 if it's not ND)
+static const uint8_t* nd(const uint8_t *data, uint16_t len, uint16_t *icmp_len)
+{
+    if ( (len < 14+40+24) || (get16(data+12) != ETH_IPV6) ) return 0;
+    const uint8_t *ip=data+14;
+    
+    // ND messages have no extension headers and hop limit 255
+    if ( (ip[6] != 58) || (ip[7] != 255) ) return 0;
+    uint16_t l=get16(ip+4);
+    if ( (l < 24) || (l > len-14-40) ) return 0;
+    
+    const uint8_t *icmp=ip+40;
+    if ( ((icmp[0] != ND_NS) && (icmp[0] != ND_NA)) || (icmp[1] != 0) ) return 0;
+    *icmp_len=l;
+    return icmp;
+}
+
+
+// Looking for link-layer address option
+static const uint8_t* nd_opt(const uint8_t *icmp, uint16_t len, uint8_t type)
+{
+    uint16_t offs=24;
+    while (offs+8 <= len)
+    {
+	uint16_t l=icmp[offs+1]*8;
+	if (l == 0) return 0;	// broken
+	if ( (icmp[offs] == type) && (l == 8) ) return icmp+offs+2;
+	offs+=l;
+    }
+    return 0;
+}
+
+
+void neigh_snoop(uint16_t tenant, const uint8_t *data, uint16_t len)
+{
+    uint16_t type=get16(data+12);
+    
+    if (type == ETH_ARP)
+    {
+	// Ethernet/IPv4 ARP only
+	if ( (len < 14+28) ||
+	     (get16(data+14) != 1) || (get16(data+16) != 0x0800) ||
+	     (data[18] != 6) || (data[19] != 4) ) return;
+	
+	// Sender of request or reply (skipping probes with 0.0.0.0)
+	const uint8_t *sha=data+22, *spa=data+28;
+	if ( (spa[0]|spa[1]|spa[2]|spa[3]) == 0 ) return;
+	
+	uint8_t ip[16];
+	mapped(ip, spa);
+	learn(tenant, ip, sha, 0);
+    } else
+    if (type == ETH_IPV6)
+    {
+	uint16_t l;
+	const uint8_t *icmp=nd(data, len, &l);
+	if (! icmp) return;
+	
+	if (icmp[0] == ND_NA)
+	{
+	    // Target address (taking src MAC if there is no TLLA option)
+	    const uint8_t *mac=nd_opt(icmp, l, ND_OPT_TLLA);
+	    learn(tenant, icmp+8, (mac) ? mac : data+6, (icmp[4] & NA_ROUTER) ? 1 : 0);
+	} else
+	{
+	    // Solicitation source (not from DAD)
+	    const uint8_t *src=data+14+8;
+	    const uint8_t *mac=nd_opt(icmp, l, ND_OPT_SLLA);
+	    if (! mac) return;
+	    struct neigh *e=lookup(tenant, src);
+	    learn(tenant, src, mac, (e) ? e->router : 0);
+	}
+    }
+}
+
+
+uint16_t neigh_answer(uint16_t tenant, const uint8_t *data, uint16_t len, uint8_t *answer)
+{
+    uint16_t type=get16(data+12);
+    time_t now=time(NULL);
+    
+    if (type == ETH_ARP)
+    {
+	// Request?
+	if ( (len < 14+28) ||
+	     (get16(data+14) != 1) || (get16(data+16) != 0x0800) ||
+	     (data[18] != 6) || (data[19] != 4) || (get16(data+20) != 1) ) return 0;
+	
+	const uint8_t *sha=data+22, *spa=data+28, *tpa=data+38;
+	if ( ((spa[0]|spa[1]|spa[2]|spa[3]) == 0) ||	// probe
+	     (memcmp(spa, tpa, 4) == 0) ) return 0;	// gratuitous
+	
+	uint8_t ip[16];
+	mapped(ip, tpa);
+	struct neigh *e=lookup(tenant, ip);
+	if ( (! e) || (e->t + neigh_timeout < now) || (memcmp(e->mac, sha, 6) == 0) ) return 0;
+	
+	// Making reply
+	memset(answer, 0, 60);
+	memcpy(answer+0, data+6, 6);	// to requester
+	memcpy(answer+6, e->mac, 6);	// from target
+	put16(answer+12, ETH_ARP);
+	put16(answer+14, 1);		// ethernet
+	put16(answer+16, 0x0800);	// IPv4
+	answer[18]=6;
+	answer[19]=4;
+	put16(answer+20, 2);		// reply
+	memcpy(answer+22, e->mac, 6);
+	memcpy(answer+28, tpa, 4);
+	memcpy(answer+32, sha, 6);
+	memcpy(answer+38, spa, 4);
+	
+	DEBUG("neigh: answered ARP request for %d.%d.%d.%d\n", tpa[0], tpa[1], tpa[2], tpa[3]);
+	return 60;	// minimal ethernet frame
+    } else
+    if (type == ETH_IPV6)
+    {
+	uint16_t l;
+	const uint8_t *icmp=nd(data, len, &l);
+	if ( (! icmp) || (icmp[0] != ND_NS) ) return 0;
+	
+	// Not answering DAD (unspecified source)
+	const uint8_t *src=data+14+8;
+	static const uint8_t zero[16]={0};
+	if (memcmp(src, zero, 16) == 0) return 0;
+	
+	const uint8_t *target=icmp+8;
+	struct neigh *e=lookup(tenant, target);
+	if ( (! e) || (e->t + neigh_timeout < now) || (memcmp(e->mac, data+6, 6) == 0) ) return 0;
+	
+	// Ethernet
+	memcpy(answer+0, data+6, 6);
+	memcpy(answer+6, e->mac, 6);
+	put16(answer+12, ETH_IPV6);
+	
+	// IPv6
+	uint8_t *ip=answer+14;
+	memset(ip, 0, 40);
+	ip[0]=0x60;
+	put16(ip+4, 32);	// payload length
+	ip[6]=58;		// ICMPv6
+	ip[7]=255;		// hop limit
+	memcpy(ip+8, target, 16);
+	memcpy(ip+24, src, 16);
+	
+	// Neighbor advertisement with target link-layer address
+	uint8_t *na=ip+40;
+	memset(na, 0, 32);
+	na[0]=ND_NA;
+	na[4]=NA_SOLICITED | NA_OVERRIDE | ((e->router) ? NA_ROUTER : 0);
+	memcpy(na+8, target, 16);
+	na[24]=ND_OPT_TLLA;
+	na[25]=1;
+	memcpy(na+26, e->mac, 6);
+	
+	// Checksum with pseudo-header
+	uint32_t sum=csum_add(0, ip+8, 32);
+	sum+=32 + 58;
+	sum=csum_add(sum, na, 32);
+	put16(na+2, ~sum & 0xffff);
+	
+	DEBUG("neigh: answered neighbor solicitation\n");
+	return 14+40+32;
+    }
+    
+    return 0;
+}
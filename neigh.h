@@ -0,0 +1,24 @@
+#ifndef NEIGH_H
+#define NEIGH_H
+
+
+#include <stdint.h>
+
+
+// Maximum size of answer packet
+#define NEIGH_MAX_ANSWER	86
+
+
+// Answer ARP/ND requests for hosts seen in last neigh_timeout sec (0 - disabled)
+extern int neigh_timeout;
+
+
+// Remember IP->MAC from ARP packet or neighbor advertisement/solicitation (hosts of tenants are apart)
+void neigh_snoop(uint16_t tenant, const uint8_t *data, uint16_t len);
+
+// Make answer for ARP request or neighbor solicitation if target is known in tenant.
+// Returns answer length or 0 if packet should be routed as usual.
+uint16_t neigh_answer(uint16_t tenant, const uint8_t *data, uint16_t len, uint8_t *answer);
+
+
+#endif
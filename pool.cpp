@@ -0,0 +1,61 @@
+#include "pool.h"
+
+#include <stdlib.h>
+
+#include "debug.h"
+
+
+// Free buffers kept for reuse (others are returned to heap)
+#define POOL_KEEP	1024
+
+// Reference counter is kept before buffer
+#define POOL_HDR	8
+
+
+static uint8_t *pool_free=0;	// list linked through first bytes of buffers
+static int pool_free_num=0;
+
+
+static inline uint32_t& refs(uint8_t *buf)
+{
+    return *(uint32_t*)(buf-POOL_HDR);
+}
+
+
+uint8_t* pool_get()
+{
+    uint8_t *buf;
+    if (pool_free)
+    {
+	buf=pool_free;
+	pool_free=*(uint8_t**)buf;
+	pool_free_num--;
+    } else
+	buf=new uint8_t[POOL_HDR+POOL_BUF_SIZE]+POOL_HDR;
+    
+    refs(buf)=1;
+    return buf;
+}
+
+
+void pool_hold(uint8_t *buf)
+{
+    refs(buf)++;
+}
+
+
+void pool_put(uint8_t *buf)
+{
+    if (! buf) return;
+    if (--refs(buf) > 0) return;
+    
+    if (pool_free_num >= POOL_KEEP)
+    {
+	delete[] (buf-POOL_HDR);
+	return;
+    }
+    
+    *(uint8_t**)buf=pool_free;
+    pool_free=buf;
+    pool_free_num++;
+}
@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+
+#include <stdint.h>
+
+
+// Size of pool buffer (biggest frame in flight with its headers)
+#define POOL_BUF_SIZE	1664
+
+// Packet data starts at buf+POOL_DATA, so TAP header (4 bytes) or frame length
+// with codec header (2+2 bytes) are prepended in place
+#define POOL_DATA	4
+
+
+// Buffers for packets in flight, shared by all connections
+// (idle connection doesn't own any of them)
+// Buffer is refcounted: pool_get() gives first reference, pool_hold() adds one,
+// pool_put() drops one (buffer is reused when the last one is gone)
+uint8_t* pool_get();
+void pool_hold(uint8_t *buf);
+void pool_put(uint8_t *buf);
+
+
+#endif
@@ -0,0 +1,95 @@
+#include "prio.h"
+
+#include <stdio.h>
+
+
+// Ethernet types
+#define ETH_VLAN	0x8100
+#define ETH_QINQ	0x88A8
+#define ETH_IPV4	0x0800
+#define ETH_IPV6	0x86DD
+
+
+// Default: CS5..CS7, VOICE-ADMIT, EF are high, CS1 and LE are low (RFC 4594, RFC 8622)
+uint8_t prio_dscp[64]=
+{
+    1, 2, 1, 1, 1, 1, 1, 1,	//  0: CS0, LE
+    2, 1, 1, 1, 1, 1, 1, 1,	//  8: CS1, AF1x
+    1, 1, 1, 1, 1, 1, 1, 1,	// 16: CS2, AF2x
+    1, 1, 1, 1, 1, 1, 1, 1,	// 24: CS3, AF3x
+    1, 1, 1, 1, 1, 1, 1, 1,	// 32: CS4, AF4x
+    0, 1, 1, 1, 0, 1, 0, 1,	// 40: CS5, VOICE-ADMIT, EF
+    0, 1, 1, 1, 1, 1, 1, 1,	// 48: CS6
+    0, 1, 1, 1, 1, 1, 1, 1,	// 56: CS7
+};
+
+// 802.1p: BK and spare are low, VI, VO, IC and NC are high (IEEE 802.1Q annex I)
+static const uint8_t prio_pcp[8]={ 1, 2, 2, 1, 1, 0, 0, 0 };
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+bool prio_map(const char *spec)
+{
+    const char *p=spec;
+    while (*p)
+    {
+	int from, to, band, n=0;
+	if (sscanf(p, "%d-%d:%d%n", &from, &to, &band, &n) != 3)
+	{
+	    n=0;
+	    if (sscanf(p, "%d:%d%n", &from, &band, &n) != 2) n=0;
+	    to=from;
+	}
+	
+	if ( (n == 0) || (from < 0) || (to > 63) || (from > to) ||
+	     (band < 0) || (band >= PRIO_BANDS) || ( (p[n] != ',') && (p[n] != 0) ) )
+	{
+	    fprintf(stderr, "Error: incorrect DSCP map\n");
+	    return false;
+	}
+	
+	for (int i=from; i<=to; i++)
+	    prio_dscp[i]=band;
+	
+	p+=n;
+	if (*p == ',') p++;
+    }
+    return true;
+}
+
+
+uint8_t prio_band(const uint8_t *data, uint16_t len)
+{
+    uint8_t band=PRIO_NORMAL;
+    bool tagged=false;
+    
+    if (len < 14) return band;
+    uint16_t type=get16(data+12);
+    uint16_t offs=14;
+    
+    // VLAN tags (outer one tells PCP)
+    while ( ((type == ETH_VLAN) || (type == ETH_QINQ)) && (len >= offs+4) )
+    {
+	if (! tagged) band=prio_pcp[data[offs] >> 5];
+	tagged=true;
+	type=get16(data+offs+2);
+	offs+=4;
+    }
+    
+    // DSCP of IP packet
+    uint8_t dscp;
+    if ( (type == ETH_IPV4) && (len >= offs+20) )
+	dscp=data[offs+1] >> 2;
+    else if ( (type == ETH_IPV6) && (len >= offs+40) )
+	dscp=( ((data[offs] & 0x0f) << 4) | (data[offs+1] >> 4) ) >> 2;
+    else
+	return band;
+    
+    if ( (! tagged) || (prio_dscp[dscp] < band) ) band=prio_dscp[dscp];
+    return band;
+}
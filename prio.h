@@ -0,0 +1,26 @@
+#ifndef PRIO_H
+#define PRIO_H
+
+
+#include <stdint.h>
+
+
+// Priority bands of send queues (lower number is sent first)
+#define PRIO_BANDS	3
+#define PRIO_HIGH	0	// voice, network control (and tinytun's own messages)
+#define PRIO_NORMAL	1
+#define PRIO_LOW	2	// background / scavenger
+
+
+// Band of every DSCP value
+extern uint8_t prio_dscp[64];
+
+
+// Setting bands of DSCP values from "DSCP[-DSCP]:BAND,..." list
+bool prio_map(const char *spec);
+
+// Band of Ethernet frame (most urgent of its VLAN PCP and IP DSCP)
+uint8_t prio_band(const uint8_t *data, uint16_t len);
+
+
+#endif
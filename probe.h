@@ -0,0 +1,54 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+
+#include <stdint.h>
+
+
+// USDT probes of data path, provider "tinytun" (perf, bpftrace and SystemTap find them
+// in .note.stapsdt as sys/sdt.h makes them). Probe is one nop until tracer attaches to it,
+// arguments are signed 8-byte values left where compiler has them.
+//
+//     bpftrace -e 'usdt:/usr/local/bin/tinytun:tinytun:write { @[arg2]=count(); }'
+//
+// Build with -DNO_PROBES to leave them out.
+#if defined(__x86_64__) && ! defined(NO_PROBES)
+
+#define PROBE_NOTE(name, args)	\
+    "990:	nop\n"	\
+    "	.pushsection .note.stapsdt,\"?\",\"note\"\n"	\
+    "	.balign 4\n"	\
+    "	.4byte 992f-991f, 994f-993f, 3\n"	\
+    "991:	.asciz \"stapsdt\"\n"	\
+    "992:	.balign 4\n"	\
+    "993:	.8byte 990b\n"	\
+    "	.8byte _.stapsdt.base\n"	\
+    "	.8byte 0\n"	\
+    "	.asciz \"tinytun\"\n"	\
+    "	.asciz \"" name "\"\n"	\
+    "	.asciz \"" args "\"\n"	\
+    "994:	.balign 4\n"	\
+    "	.popsection\n"	\
+    "	.ifndef _.stapsdt.base\n"	\
+    "	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"	\
+    "	.weak _.stapsdt.base\n"	\
+    "	.hidden _.stapsdt.base\n"	\
+    "_.stapsdt.base:	.space 1\n"	\
+    "	.size _.stapsdt.base, 1\n"	\
+    "	.popsection\n"	\
+    "	.endif\n"
+
+#define PROBE2(name, a, b)	\
+    __asm__ __volatile__ (PROBE_NOTE(#name, "-8@%0 -8@%1") :: "nor"((int64_t)(a)), "nor"((int64_t)(b)))
+#define PROBE3(name, a, b, c)	\
+    __asm__ __volatile__ (PROBE_NOTE(#name, "-8@%0 -8@%1 -8@%2") :: "nor"((int64_t)(a)), "nor"((int64_t)(b)), "nor"((int64_t)(c)))
+
+#else
+
+#define PROBE2(name, a, b)	do{}while(0)
+#define PROBE3(name, a, b, c)	do{}while(0)
+
+#endif
+
+
+#endif
@@ -0,0 +1,444 @@
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "conn.h"
+#include "codec.h"
+#include "conntab.h"
+#include "server.h"
+#include "capture.h"
+#include "acl.h"
+#include "cycles.h"
+#include "debug.h"
+
+
+// pcapng block types (see capture.cpp)
+#define PCAPNG_SHB	0x0A0D0D0A
+#define PCAPNG_EPB	0x00000006
+
+// pcapng option codes
+#define OPT_ENDOFOPT	0
+#define OPT_COMMENT	1
+#define OPT_EPB_FLAGS	2
+
+// Frames routed between writes of connection queues
+#define WRITE_BATCH	64
+
+// Sources are looked up by peer address
+#define MAX_SOURCES	32768
+#define HASH_SIZE	65536
+
+
+// Frame of trace
+struct rec
+{
+    uint64_t ts;
+    const uint8_t *hdr;
+    uint16_t caplen, len;
+    int src;	// -1 - local netif
+};
+
+// Mock connection: Conn on one end of socketpair, we're on the other
+struct source
+{
+    uint64_t key;	// addr<<16 | port, 0 - free hash slot
+    Conn *conn;
+    int peer_fd;
+};
+
+static struct source *sources=0;
+static int sources_num=0;
+static int *hash=0;	// index in sources+1, 0 - free
+
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+static inline uint16_t get16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+// Reading everything queued to mock connection's socket
+static void drain(int fd)
+{
+    static uint8_t buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+
+// Reading frames of mock connection's stream back (short writes mustn't break it), returns false if it's broken
+static bool check_stream(int fd, const uint8_t *key, uint64_t *frames)
+{
+    static uint8_t buf[2*65536+2];
+    static int have=0;	// bytes of frame not read whole yet
+    const struct suite *s=suite_find(SUITE_LEGACY);
+    
+    int r;
+    while ( (r=read(fd, buf+have, 65536)) > 0)
+    {
+	have+=r;
+	int pos=0;
+	while (have-pos >= 2)
+	{
+	    uint16_t sz=buf[pos] | (buf[pos+1] << 8);
+	    if (have-pos < 2+sz) break;
+	    uint16_t flags;
+	    if (s->decode(buf+pos+2, sz, &flags, key) < 0) return false;
+	    (*frames)++;
+	    pos+=2+sz;
+	}
+	memmove(buf, buf+pos, have-pos);
+	have-=pos;
+    }
+    return true;
+}
+
+
+// Connection with handshake done (seed isn't marked, so there are no control messages)
+static Conn* mock_conn(int *peer_fd)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return 0;
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    
+    Conn *c=new Conn(sv[0], 0);
+    
+    uint8_t seed[18];
+    seed[0]=16;
+    seed[1]=0;
+    for (int i=2; i<18; i++)
+	seed[i]=rand();
+    if (write(sv[1], seed, sizeof(seed)) != sizeof(seed)) return 0;
+    c->doRead();
+    drain(sv[1]);
+    
+    (*peer_fd)=sv[1];
+    return c;
+}
+
+
+// Source connection of frame by its capture comment
+static int find_source(const char *comment)
+{
+    int a[4], port;
+    if (sscanf(comment, "peer %d.%d.%d.%d:%d", a+0, a+1, a+2, a+3, &port) != 5) return -1;
+    
+    uint32_t addr=htonl((a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3]);
+    uint64_t key=((uint64_t)addr << 16) | port;
+    
+    uint32_t h=(key * 0x9E3779B97F4A7C15ULL) >> 48;
+    while (hash[h % HASH_SIZE])
+    {
+	int i=hash[h % HASH_SIZE]-1;
+	if (sources[i].key == key) return i;
+	h++;
+    }
+    
+    if (sources_num >= MAX_SOURCES) return -2;
+    struct source *s=&sources[sources_num];
+    s->key=key;
+    s->conn=mock_conn(&s->peer_fd);
+    if (! s->conn) return -2;
+    s->conn->addr=addr;
+    s->conn->port=htons(port);
+    conntab_add(s->conn);
+    hash[h % HASH_SIZE]=++sources_num;
+    return sources_num-1;
+}
+
+
+static int by_ts(const void *a, const void *b)
+{
+    const struct rec *x=(const struct rec*)a, *y=(const struct rec*)b;
+    return (x->ts < y->ts) ? -1 : (x->ts > y->ts);
+}
+
+
+// Parsing capture ring (empty slots are skipped, frames are sorted by time)
+static struct rec* load(const uint8_t *p, size_t size, int *n)
+{
+    if ( (size < 12) || (get32(p) != PCAPNG_SHB) ) return 0;
+    
+    // Counting frames
+    int count=0;
+    for (size_t o=0; o+12 <= size; )
+    {
+	uint32_t blen=get32(p+o+4);
+	if ( (blen < 12) || (o+blen > size) ) break;
+	if (get32(p+o) == PCAPNG_EPB) count++;
+	o+=blen;
+    }
+    
+    struct rec *r=new struct rec[count+1];
+    (*n)=0;
+    for (size_t o=0; o+12 <= size; )
+    {
+	const uint8_t *b=p+o;
+	uint32_t blen=get32(b+4);
+	if ( (blen < 12) || (o+blen > size) ) break;
+	o+=blen;
+	if ( (get32(b) != PCAPNG_EPB) || (blen < 32) ) continue;
+	
+	struct rec *e=&r[*n];
+	e->ts=((uint64_t)get32(b+12) << 32) | get32(b+16);
+	e->caplen=get32(b+20);
+	e->len=get32(b+24);
+	e->hdr=b+28;
+	e->src=-1;
+	if ( (e->caplen < 14) || (e->caplen > e->len) || (e->len > 1600) || (28u+e->caplen > blen) ) continue;
+	
+	// Options: direction and peer
+	uint8_t dir=0;
+	const char *comment="";
+	char cbuf[64];
+	for (uint32_t oo=28+((e->caplen+3) & ~3); oo+4 <= blen-4; )
+	{
+	    uint16_t code=get16(b+oo), olen=get16(b+oo+2);
+	    if (code == OPT_ENDOFOPT) break;
+	    if ( (code == OPT_EPB_FLAGS) && (olen >= 4) ) dir=get32(b+oo+4);
+	    if (code == OPT_COMMENT)
+	    {
+		int l=(olen < sizeof(cbuf)-1) ? olen : sizeof(cbuf)-1;
+		memcpy(cbuf, b+oo+4, l);
+		cbuf[l]=0;
+		comment=cbuf;
+	    }
+	    oo+=4+((olen+3) & ~3);
+	}
+	
+	if (dir == CAPTURE_IN)
+	{
+	    e->src=find_source(comment);
+	    if (e->src == -2)
+	    {
+		fprintf(stderr, "Error: too many connections in trace\n");
+		delete[] r;
+		return 0;
+	    }
+	    if (e->src < 0) continue;
+	} else
+	if (dir != CAPTURE_OUT)
+	    continue;
+	
+	(*n)++;
+    }
+    
+    qsort(r, *n, sizeof(struct rec), by_ts);
+    return r;
+}
+
+
+static void report(const char *name, uint64_t ns, uint64_t n, const char *unit)
+{
+    printf("  %-8s %10.3f ms  %8.1f ns/%s\n", name, ns/1e6, (n > 0) ? (double)ns/n : 0.0, unit);
+}
+
+
+bool replay(const char *file)
+{
+    // Mapping trace
+    int fd=open(file, O_RDONLY);
+    if (fd < 0)
+    {
+	perror(file);
+	return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    const uint8_t *map=(const uint8_t*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+	perror("mmap");
+	return false;
+    }
+    
+    // Two fds for every source
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+	rl.rlim_cur=rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    
+    if (! conntab_init()) return false;
+    sources=new struct source[MAX_SOURCES];
+    hash=new int[HASH_SIZE]();
+    
+    int n=0;
+    struct rec *r=load(map, st.st_size, &n);
+    if (! r)
+    {
+	fprintf(stderr, "Error: %s isn't a tinytun capture\n", file);
+	return false;
+    }
+    if (n == 0)
+    {
+	fprintf(stderr, "Error: no frames in %s\n", file);
+	return false;
+    }
+    
+    // Timer cost (subtracted from every measurement)
+    uint64_t t0=now_ns();
+    for (int i=0; i<1000; i++)
+	now_ns();
+    uint64_t tcost=(now_ns()-t0)/1001;
+    
+    uint64_t t_learn=0, t_route=0, t_write=0, t_send=0;
+    uint64_t bytes=0, copies=0;
+    uint64_t unicast=0, flood_bcast=0, flood_unknown=0, dropped=0, denied=0;
+    uint16_t *fanout=new uint16_t[n];
+    uint8_t frame[1600];
+    memset(frame, 0, sizeof(frame));
+    
+    // Pass 1: learning, routing (with sending) and writing queues
+    memset(cycles_stages, 0, sizeof(cycles_stages));	// handshakes of mock connections aren't counted
+    uint64_t start=now_ns();
+    for (int i=0; i<n; i++)
+    {
+	struct rec *e=&r[i];
+	memcpy(frame, e->hdr, e->caplen);	// rest of frame is zeroes
+	Conn *src=(e->src >= 0) ? sources[e->src].conn : 0;
+	bytes+=e->len;
+	
+	// Checking ACL and learning src MAC as Conn::handlePkt does (denied frame goes no further)
+	uint64_t t=now_ns();
+	bool pass=acl_pass((src) ? src->tenant : 0, (src) ? src->addr : 0, (src) ? ACL_IN : ACL_OUT, frame, e->len);
+	if ( (pass) && (src) ) src->addMAC(frame+6);
+	uint64_t t2=now_ns();
+	t_learn+=t2-t-tcost;
+	
+	// Routing
+	uint64_t tx=0;
+	for (int j=0; j<conns_num; j++)
+	    tx+=conns[j]->tx_pkts;
+	t=now_ns();
+	if (pass) server_route(src, frame, e->len);
+	t2=now_ns();
+	t_route+=t2-t-tcost;
+	for (int j=0; j<conns_num; j++)
+	    tx-=conns[j]->tx_pkts;
+	fanout[i]=-tx;
+	copies+=fanout[i];
+	
+	if (! pass)
+	    denied++; else
+	if (fanout[i] == 0)
+	    dropped++; else
+	if (frame[0] & 1)
+	    flood_bcast++; else
+	if (fanout[i] > 1)
+	    flood_unknown++; else
+	    unicast++;
+	
+	// Writing queues to mock sockets
+	if ( (i % WRITE_BATCH == WRITE_BATCH-1) || (i == n-1) )
+	{
+	    for (int j=0; j<sources_num; j++)
+	    {
+		Conn *c=sources[j].conn;
+		if (c->st->outq_size == 0) continue;
+		t=now_ns();
+		c->doWrite();
+		t_write+=now_ns()-t-tcost;
+		drain(sources[j].peer_fd);
+	    }
+	}
+    }
+    uint64_t total=now_ns()-start;
+    struct cycles_stage stages[CYC_STAGES];
+    memcpy(stages, cycles_stages, sizeof(stages));
+    
+    // Pass 2: sending alone (route cost is the rest), small socket buffer makes writes short
+    Conn *sink=sources[0].conn;
+    int sink_fd=sources[0].peer_fd;
+    while ( (sink->st->outq_size > 0) && (! sink->st->fin) )
+    {
+	sink->doWrite();	// stream starts at frame boundary
+	drain(sink_fd);
+    }
+    int sndbuf=4096;
+    setsockopt(sink->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    uint64_t stream=0;
+    bool stream_ok=true;
+    for (int i=0; i<n; i++)
+    {
+	struct rec *e=&r[i];
+	memcpy(frame, e->hdr, e->caplen);
+	for (int k=0; k<fanout[i]; k++)
+	{
+	    uint64_t t=now_ns();
+	    sink->send(frame, e->len);
+	    t_send+=now_ns()-t-tcost;
+	    while ( (stream_ok) && (sink->st->outq_size > 65536) && (! sink->st->fin) )
+	    {
+		sink->doWrite();
+		stream_ok=check_stream(sink_fd, sink->writeKey, &stream);
+	    }
+	}
+    }
+    while ( (stream_ok) && (sink->st->outq_size > 0) && (! sink->st->fin) )
+    {
+	sink->doWrite();
+	stream_ok=check_stream(sink_fd, sink->writeKey, &stream);
+    }
+    
+    // Report
+    double span=(r[n-1].ts - r[0].ts)/1e6;
+    printf("Trace: %d frames, %llu bytes, %d connections, %.3f sec (%.0f frames/s)\n", n,
+	   (unsigned long long)bytes, sources_num, span, (span > 0) ? n/span : 0.0);
+    printf("Replay: %.3f ms, %.0f frames/s, %.2f copies/frame\n", total/1e6, n/(total/1e9), (double)copies/n);
+    report("learn", t_learn, n, "frame");
+    report("route", (t_route > t_send) ? t_route-t_send : 0, n, "frame");
+    report("send", t_send, copies, "copy");
+    report("write", t_write, n, "frame");
+    printf("Frames:\n");
+    printf("  unicast  %10llu  %5.1f%%\n", (unsigned long long)unicast, 100.0*unicast/n);
+    printf("  flood    %10llu  %5.1f%% (broadcast/multicast)\n", (unsigned long long)flood_bcast, 100.0*flood_bcast/n);
+    printf("  flood    %10llu  %5.1f%% (unknown unicast)\n", (unsigned long long)flood_unknown, 100.0*flood_unknown/n);
+    printf("  dropped  %10llu  %5.1f%% (nobody to send to, answered or parked)\n", (unsigned long long)dropped, 100.0*dropped/n);
+    if (acl_tables) printf("  denied   %10llu  %5.1f%% (by ACL)\n", (unsigned long long)denied, 100.0*denied/n);
+#ifdef CYCLES
+    printf("Cycles:\n");
+    cycles_report(stdout, stages);
+#endif
+    
+    // Everything sent in pass 2 has to come out of socket as it was queued
+    if (stream != copies)
+    {
+	fprintf(stderr, "Error: written stream is broken (%llu of %llu frames read back)\n",
+		(unsigned long long)stream, (unsigned long long)copies);
+	return false;
+    }
+    
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+
+// Feeding frames captured by server (--pcap) through routing with mock connections
+// and printing cost of every stage
+bool replay(const char *file);
+
+
+#endif
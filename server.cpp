@@ -4,9 +4,10 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
@@ -16,117 +17,930 @@
 #include <sys/resource.h>
 
 #include "conn.h"
+#include "crypt.h"
 #include "tap.h"
+#include "capture.h"
+#include "acl.h"
+#include "neigh.h"
+#include "mcast.h"
+#include "bridge.h"
+#include "handover.h"
+#include "conntab.h"
+#include "latency.h"
+#include "mss.h"
+#include "pool.h"
+#include "shortcut.h"
+#include "cycles.h"
+#include "probe.h"
+#include "tenant.h"
 #include "debug.h"
 
 
-Conn *tcp_conn=0;
+// Closed connections waiting for client to resume session
+Conn *parked_conn=0;
 
+// How long closed sessions can be resumed (0 - disabled)
+int resume_grace=30;
 
-static bool route(Conn *src, const uint8_t *data, uint16_t len)
+// UNIX socket for handing everything over to new process (0 - disabled)
+const char *handover_path=0;
+
+
+// Other servers of mesh
+#define MAX_PEERS	16
+#define PEER_RETRY	2	// sec between connection tries
+#define PEER_MAC_TABLE	1024	// MACs behind other server
+#define MACS_PER_MSG	200	// MACs in one CTL_MAC_ADD/CTL_MAC_DEL
+
+#define THROTTLE_TICK	10	// ms between refills of rate limited connections
+#define TAP_BUDGET	32	// frames read from TAP per wakeup
+
+// Reconnect storms (every client of restarted server comes back at once)
+#define LISTEN_BACKLOG	4096	// kernel caps it to net.core.somaxconn
+#define ACCEPT_BUDGET	64	// connections accepted per wakeup
+#define HANDSHAKES_MAX	1024	// more connections wait in listen queue
+#define HANDSHAKE_TIME	10	// sec for new connection to send its seed
+#define RESUME_WAIT	10	// sec after disconnect while client is expected to resume its session
+
+static struct peer_link
+{
+    struct sockaddr_in addr;
+    Conn *conn;
+    time_t retry_t;
+} peer_link[MAX_PEERS];
+static int peer_links=0;
+
+// Our id in mesh
+static uint64_t server_id;
+
+
+// Pool buffer of packet read from TAP (while it's routed)
+static uint8_t *local_pkt=0;
+
+// Default network (tenant 0)
+#define DEFAULT_NET	(&tenants[0])
+
+// Pool buffer holding packet (0 if it's somewhere else)
+static uint8_t* route_pkt(Conn *src, const uint8_t *data)
+{
+    uint8_t *pkt=(src) ? src->rd.buf : local_pkt;
+    return ( (pkt) && (data == pkt+POOL_DATA) ) ? pkt : 0;
+}
+
+
+// Sending packet to local netif of tenant (TAP or bridged interface)
+static void local_write(const struct tenant *t, const uint8_t *data, uint16_t len, uint8_t *pkt=0)
+{
+    if (t->tap_fd>=0)
+    {
+	// Packet in pool buffer has room for TAP header
+	if (pkt)
+	    tap_write_buf(pkt+POOL_DATA-4, len, t->tap_fd); else
+	    tap_write(data, len, t->tap_fd);
+    } else
+    if ( (bridge_fd>=0) && (t == DEFAULT_NET) )
+	bridge_write(data, len);
+}
+
+
+// Checking if packet from src can be sent to c (packets from other servers are never sent to servers)
+static inline bool can_send(Conn *src, Conn *c)
+{
+    return (c!=src) && ( (! src) || (! src->peer) || (! c->peer) );
+}
+
+
+// Queueing packet to c (frame from local netif is dropped for connection over its high watermark,
+// so one slow client can't hold the netif reader for everybody)
+static inline void deliver(Conn *src, Conn *c, const uint8_t *data, uint16_t len, uint8_t *pkt)
+{
+    if ( (! src) && (c->st->congested) )
+    {
+	PROBE2(drop, c, len);
+	return;
+    }
+    c->send(data, len, pkt);
+}
+
+
+// Routing packet from src (0 - local netif) inside tenant t
+static bool forward(struct tenant *t, Conn *src, const uint8_t *data, uint16_t len)
 {
     static const uint8_t bcast_mac[6]={0xff,0xff,0xff,0xff,0xff,0xff};
     
     // First 6 bytes of packet is dst MAC
     const uint8_t *dst=(data+0);
+    uint8_t *pkt=route_pkt(src, data);
+    PROBE2(route, src, len);
     
     // Checking for broadcast
     bool bcast=(memcmp(dst, bcast_mac, 6)==0);
     
+    uint16_t tenant=t-tenants;
+    
+    if (neigh_timeout > 0)
+    {
+	// Remembering neighbors
+	neigh_snoop(tenant, data, len);
+	
+	// Answering ARP/ND requests ourself if we know the answer
+	if (dst[0] & 1)
+	{
+	    uint8_t answer[NEIGH_MAX_ANSWER];
+	    uint16_t l=neigh_answer(tenant, data, len, answer);
+	    if (l > 0)
+	    {
+		if (src)
+		    src->send(answer, l); else
+		    local_write(t, answer, l);
+		return true;
+	    }
+	}
+    }
+    
+    // Routing multicast to subscribed connections
+    if ( (mcast_timeout > 0) && (dst[0] & 1) && (! bcast) )
+    {
+	if (src) mcast_snoop(src, data, len);
+	
+	if (mcast_snooped(dst))
+	{
+	    bool found=false;
+	    time_t now=time(NULL);
+	    for (int i=0; i<t->conns_num; i++)
+	    {
+		Conn *c=t->conns[i];
+		if ( (! c->peer) && (can_send(src, c)) && (c->inGroup(dst, now)) )
+		{
+		    deliver(src, c, data, len, pkt);
+		    found=true;
+		}
+	    }
+	    
+	    // Other servers decide themselves (each of them gets it once)
+	    for (int i=0; i<t->conns_num; i++)
+	    {
+		Conn *c=t->conns[i];
+		if ( (c->peer) && (can_send(src, c)) )
+		    deliver(src, c, data, len, pkt);
+	    }
+	    
+	    // Nobody has joined the group - flooding clients (servers have it already)
+	    for (int i=0; (! found) && (mcast_flood_unknown) && (i < t->conns_num); i++)
+	    {
+		Conn *c=t->conns[i];
+		if ( (! c->peer) && (can_send(src, c)) )
+		    deliver(src, c, data, len, pkt);
+	    }
+	    
+	    // Local netif decides itself
+	    if (src) local_write(t, data, len, pkt);
+	    return true;
+	}
+    }
+    
     // Trying to route packet to connection with matching src MAC (if it's not a broadcast)
     if (! bcast)
     {
 	// Checking all connections
 	bool found=false;
-	Conn *c=tcp_conn;
-	while (c)
+	Conn *to=0;	// the only one which has MAC
+	for (int i=0; i<t->conns_num; i++)
 	{
 	    // Routing to connection if MAC is found
-	    if ( (c!=src) && (c->findMAC(dst)) )
+	    Conn *c=t->conns[i];
+	    if ( (can_send(src, c)) && (c->findMAC(dst)) )
 	    {
-		c->send(data, len);
+		deliver(src, c, data, len, pkt);
+		to=(found) ? 0 : c;
 		found=true;
 	    }
+	}
+	if (found)
+	{
+	    // Busy pairs of clients get direct link
+	    if ( (to) && (src) && (src->shortcuts) && (to->shortcuts) && (shortcut_pps > 0) ) shortcut_count(src, to);
+	    return true;
+	}
+	
+	// Not flooding packets for clients which are reconnecting now (if they aren't back soon,
+	// they have lost their sessions and are flooded as usual)
+	time_t now=time(NULL);
+	Conn *c=parked_conn;
+	while (c)
+	{
+	    if ( (c->tenant == tenant) && (c->st->timeout_t-resume_grace+RESUME_WAIT > now) && (c->findMAC(dst)) )
+	    {
+		DEBUG("Dropping packet for parked session\n");
+		return true;
+	    }
 	    
 	    c=c->next;
 	}
-	if (found) return true;
     }
     
     // MAC not found (or it's a broadcast) - sending packet to all connections except src
-    Conn *c=tcp_conn;
-    while (c)
+    for (int i=0; i<t->conns_num; i++)
     {
-	if (c!=src)
-	    c->send(data, len);
-	
-	c=c->next;
+	Conn *c=t->conns[i];
+	if (can_send(src, c))
+	    deliver(src, c, data, len, pkt);
     }
     
-    if ( (src) && (tap_fd>=0) )
+    if (src)
     {
 	// Sending to TAP
-	uint8_t buf[len+4];
+	local_write(t, data, len, pkt);
+    }
+    
+    return true;
+}
+
+
+// Packet from connection
+static bool route(Conn *src, const uint8_t *data, uint16_t len)
+{
+    return forward(&tenants[src->tenant], src, data, len);
+}
+
+
+bool server_route(Conn *src, const uint8_t *data, uint16_t len)
+{
+    return forward((src) ? &tenants[src->tenant] : DEFAULT_NET, src, data, len);
+}
+
+
+// Packet from local netif of tenant
+static void tenant_read(struct tenant *t, const uint8_t *data, uint16_t len)
+{
+    if (! acl_pass(t-tenants, 0, ACL_OUT, data, len))
+    {
+	PROBE2(deny, 0, len);
+	return;
+    }
+    capture(0, data, len, CAPTURE_OUT);
+    forward(t, 0, data, len);
+}
+
+
+// Packet from bridged interface
+static void local_read(const uint8_t *data, uint16_t len)
+{
+    tenant_read(DEFAULT_NET, data, len);
+}
+
+
+// Telling other servers about MACs behind us (mesh carries only default network)
+static void announce(uint8_t type, const uint8_t *macs, uint16_t n, Conn *to=0)
+{
+    for (int i=0; i<DEFAULT_NET->conns_num; i++)
+    {
+	Conn *c=DEFAULT_NET->conns[i];
+	if ( (c->peer) && (c->readKey) && ((! to) || (c==to)) )
+	    c->sendCtl(type, macs, n*6);
+    }
+}
+
+
+// Adding MACs of client connection to announce (it's sent when buffer is full)
+static void collect(Conn *c, uint8_t type, Conn *to, uint8_t *buf, uint16_t *n)
+{
+    if ( (c->peer) || (! c->mac_table) || (c->tenant != 0) ) return;
+    
+    for (uint16_t i=0; i<c->mac_table_len; i++)
+    {
+	if (c->mac_table[i].use == 0) continue;
+	
+	memcpy(buf+(*n)*6, c->mac_table[i].mac, 6);
+	if (++(*n) >= MACS_PER_MSG)
+	{
+	    announce(type, buf, *n, to);
+	    (*n)=0;
+	}
+    }
+}
+
+
+// Connection is closed for good
+static void forget(Conn *c)
+{
+    // Other servers shouldn't send packets for its MACs to us
+    uint8_t buf[MACS_PER_MSG*6];
+    uint16_t n=0;
+    collect(c, CTL_MAC_DEL, 0, buf, &n);
+    if (n > 0) announce(CTL_MAC_DEL, buf, n);
+    
+    // Link to other server will be made again
+    for (int i=0; i<peer_links; i++)
+	if (peer_link[i].conn == c) peer_link[i].conn=0;
+    
+    delete c;
+}
+
+
+// Removing MAC from other connections tables (it's behind src now)
+static void moved(Conn *src, const uint8_t *mac)
+{
+    struct tenant *t=&tenants[src->tenant];
+    for (int i=0; i<t->conns_num; i++)
+	if (t->conns[i]!=src) t->conns[i]->delMAC(mac);
+    
+    Conn* *ent=&parked_conn;
+    while (*ent)
+    {
+	Conn *c=(*ent);
+	if ( (c->tenant == src->tenant) && (c->findMAC(mac)) )
+	{
+	    c->delMAC(mac);
+	    
+	    // Older client is back, it can't resume its session (new one sends CTL_RESUME after hello)
+	    if (! src->ext)
+	    {
+		DEBUG("Forgetting parked session\n");
+		(*ent)=c->next;
+		forget(c);
+		continue;
+	    }
+	}
+	ent=&c->next;
+    }
+}
+
+
+// Link made by other side is used instead of our one
+static void relink(Conn *from, Conn *to)
+{
+    for (int i=0; i<peer_links; i++)
+	if (peer_link[i].conn == from) peer_link[i].conn=to;
+}
+
+
+// Connection is ours to --peer server or comes from address of one
+static bool peer_known(const Conn *c)
+{
+    if (c->outgoing) return true;
+    for (int i=0; i<peer_links; i++)
+	if (peer_link[i].addr.sin_addr.s_addr == c->addr) return true;
+    return false;
+}
+
+
+static bool peer_hello(Conn *src, const uint8_t *data, uint16_t len)
+{
+    uint64_t id;
+    
+    if (len != 8) return false;
+    
+    // Client can't make itself server of mesh
+    if (! peer_known(src))
+    {
+	DEBUG("Server: peer hello from unknown address\n");
+	return false;
+    }
+    memcpy(&id, data, 8);
+    
+    // Connected to ourself? Not trying it again
+    if (id == server_id)
+    {
+	for (int i=0; i<peer_links; i++)
+	    if (peer_link[i].conn == src) peer_link[i].retry_t=(time_t)0x7fffffff;
+	return false;
+    }
+    
+    // Answering to server which has connected to us
+    if (! src->outgoing)
+    {
+	if (! src->sendCtl(CTL_PEER, (const uint8_t*)&server_id, 8)) return false;
+	if (! src->mac_table) src->mac_table_len=PEER_MAC_TABLE;
+    }
+    
+    // Keeping one link between two servers: made by server with lower id (or the newest one)
+    uint64_t src_by=(src->outgoing) ? server_id : id;
+    for (int i=0; i<DEFAULT_NET->conns_num; i++)
+    {
+	Conn *c=DEFAULT_NET->conns[i];
+	if ( (c!=src) && (c->peer) && (c->peer_id == id) && (! c->st->fin) )
+	{
+	    uint64_t c_by=(c->outgoing) ? server_id : id;
+	    if (src_by > c_by)
+	    {
+		relink(src, c);
+		return false;
+	    }
+	    relink(c, src);
+	    c->detach();
+	}
+    }
+    
+    DEBUG("Server %016llx connected\n", (unsigned long long)id);
+    src->peer=true;
+    src->peer_id=id;
+    
+    // Telling it about our clients
+    uint8_t buf[MACS_PER_MSG*6];
+    uint16_t n=0;
+    for (int i=0; i<DEFAULT_NET->conns_num; i++)
+	collect(DEFAULT_NET->conns[i], CTL_MAC_ADD, src, buf, &n);
+    for (Conn *c=parked_conn; c; c=c->next)
+	collect(c, CTL_MAC_ADD, src, buf, &n);
+    if (n > 0) announce(CTL_MAC_ADD, buf, n, src);
+    return true;
+}
+
+
+static bool control(Conn *src, uint8_t type, const uint8_t *data, uint16_t len)
+{
+    switch (type)
+    {
+	case CTL_READY:
+	    // Introducing ourself to other server
+	    if (src->outgoing)
+		return src->sendCtl(CTL_PEER, (const uint8_t*)&server_id, 8);
+	    
+	    // Giving new session to client
+	    rand128(src->session);
+	    return src->sendCtl(CTL_SESSION, src->session, 16);
+	
+	case CTL_LEARN:
+	    // New MAC behind client
+	    if (! src->peer)
+	    {
+		moved(src, data);
+		if (src->tenant == 0) announce(CTL_MAC_ADD, data, 1);
+	    }
+	    return true;
+	
+	case CTL_TENANT:
+	    // Client is routed with others of its tenant now
+	    return tenant_join(src);
+	
+	case CTL_PEER:
+	    if (src->tenant != 0) return false;	// other servers have key of default network
+	    return peer_hello(src, data, len);
+	
+	case CTL_SHORTCUT:
+	case CTL_SC_PORT:
+	    return shortcut_server_ctl(src, type, data, len);
+	
+	case CTL_MAC_ADD:
+	case CTL_MAC_DEL:
+	    if (! src->peer) return true;	// only servers tell it
+	    for (uint16_t i=0; i+6<=len; i+=6)
+	    {
+		if (type == CTL_MAC_ADD)
+		{
+		    moved(src, data+i);
+		    src->addMAC(data+i);
+		} else
+		    src->delMAC(data+i);
+	    }
+	    return true;
+	
+	case CTL_RESUME:
+	    {
+		if (len != 16) return false;
+		
+		// Looking for parked session
+		Conn* *ent=&parked_conn;
+		while (*ent)
+		{
+		    if ( (memcmp((*ent)->session, data, 16)==0) && ((*ent)->tenant == src->tenant) )
+		    {
+			// Found - taking its state
+			Conn *old=(*ent);
+			(*ent)=old->next;
+			
+			DEBUG("Session resumed\n");
+			src->adopt(old);
+			delete old;
+			break;
+		    }
+		    
+		    ent=&( (*ent)->next );
+		}
+	    }
+	    return true;
+    }
+    
+    // Unknown message
+    return true;
+}
+
+
+static void park(Conn *c)
+{
+    shortcut_forget(c);
+    
+    // Checking if there is something to keep
+    if ( (resume_grace <= 0) || (! c->ext) || (! c->mac_table) || (c->peer) )
+    {
+	forget(c);
+	return;
+    }
+    
+    DEBUG("Parking session\n");
+    c->detach();
+    c->st->timeout_t=time(NULL) + resume_grace;
+    c->next=parked_conn;
+    parked_conn=c;
+}
+
+
+// Packets from TAP of tenant (up to budget)
+static void tap_events(struct tenant *t)
+{
+    for (int n=0; n < TAP_BUDGET; n++)
+    {
+	// Reading into pool buffer, so connections queue packet without copying it
+	uint8_t *pkt=pool_get();
+	int len=read(t->tap_fd, pkt+POOL_DATA-4, 1600);
+	if (len > (4+14))	// TAP header + Ethernet header
+	{
+	    // Sending to peers
+	    local_pkt=pkt;
+	    mss_clamp(pkt+POOL_DATA, len-4);
+	    tenant_read(t, pkt+POOL_DATA, len-4);	// removing TAP header
+	    local_pkt=0;
+	    pool_put(pkt);
+	} else
+	{
+	    pool_put(pkt);
+	    if ( (len > 0) || (errno != EAGAIN) ) DEBUG("Error reading from TAP (errno=%d)\n", errno);
+	    if (len <= 0) break;
+	}
+    }
+}
+
+
+bool server_add_peer(const char *host_port)
+{
+    char host[256];
+    int port;
+    struct hostent *hp;
+    
+    if ( (peer_links >= MAX_PEERS) ||
+	 (sscanf(host_port, "%255[^:]:%d", host, &port) != 2) ||
+	 (port < 1) || (port > 65535) )
+    {
+	fprintf(stderr, "Error: incorrect peer %s\n", host_port);
+	return false;
+    }
+    
+    if ( ((hp=gethostbyname(host)) == 0) || (hp->h_addrtype != AF_INET) )
+    {
+	fprintf(stderr, "Error: unable to resolve '%s'\n", host);
+	return false;
+    }
+    
+    struct peer_link *p=&peer_link[peer_links++];
+    memset(p, 0, sizeof(*p));
+    memcpy(&p->addr.sin_addr, hp->h_addr, 4);
+    p->addr.sin_family=AF_INET;
+    p->addr.sin_port=htons(port);
+    return true;
+}
+
+
+// Connecting to other servers (if not connected yet)
+static void connect_peers()
+{
+    time_t now=time(NULL);
+    
+    for (int i=0; i<peer_links; i++)
+    {
+	struct peer_link *p=&peer_link[i];
+	if ( (p->conn) || (now < p->retry_t) ) continue;
+	p->retry_t=now + PEER_RETRY;
+	
+	int sock=socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) continue;
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	if ( (connect(sock, (struct sockaddr*)&p->addr, sizeof(p->addr)) < 0) && (errno != EINPROGRESS) )
+	{
+	    close(sock);
+	    continue;
+	}
+	
+	// Connection result will be known when seed is written
+	Conn *c=new Conn(sock, route);
+	if (! c)
+	{
+	    close(sock);
+	    continue;
+	}
+	c->ctl=control;
+	c->peer=true;
+	c->outgoing=true;
+	c->ext=true;	// servers of mesh are new ones
+	c->mac_table_len=PEER_MAC_TABLE;
+	if (! conntab_add(c))
+	{
+	    delete c;
+	    continue;
+	}
+	p->conn=c;
+    }
+}
+
+
+// Fingerprint of tenant's key (fixed block encrypted with it), processes compare them on handover
+static void key_print(int t, uint8_t *print)
+{
+    static const uint8_t block[16]={ 'T','i','n','y','T','U','N',' ','h','a','n','d','o','v','e','r' };
+    memcpy(print, block, 16);
+    encrypt128(print, tenants[t].key);
+}
+
+
+static bool give_conn(int hs, Conn *c, int sock)
+{
+    uint32_t len;
+    uint8_t *data=c->save(&len);
+    bool ok=handover_send(hs, sock, data, len);
+    delete[] data;
+    return ok;
+}
+
+
+// Giving sockets & connections to new process which has connected to handover socket
+static void give_away(int hl, int SrvSock)
+{
+    int hs=handover_accept(hl);
+    if (hs < 0) return;
+    
+    // Closed connections are parked before
+    for (int i=conns_num-1; i>=0; i--)
+    {
+	if (conns[i]->needClose())
+	{
+	    Conn *c=conns[i];
+	    conntab_del(i);
+	    park(c);
+	}
+    }
+    
+    // Not waiting forever for hung process
+    struct timeval tv={ 5, 0 };
+    setsockopt(hs, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(hs, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    
+    // Header with server socket
+    uint32_t version=HANDOVER_VERSION, active=conns_num, parked=0, tenant_nets=tenants_num;
+    for (Conn *c=parked_conn; c; c=c->next) parked++;
+    
+    uint8_t hdr[24+16*tenants_num];
+    struct handover_io s;
+    memset(&s, 0, sizeof(s));
+    s.out=hdr;
+    s.io(&version, sizeof(version));
+    s.io(&server_id, sizeof(server_id));
+    s.io(&active, sizeof(active));
+    s.io(&parked, sizeof(parked));
+    s.io(&tenant_nets, sizeof(tenant_nets));
+    for (int i=0; i<tenants_num; i++)
+    {
+	uint8_t print[16];
+	key_print(i, print);
+	s.io(print, 16);
+    }
+    
+    bool ok=(handover_send(hs, SrvSock, hdr, s.pos)) &&
+	    (handover_send(hs, tap_fd, 0, 0));
+    
+    // TAPs of tenants
+    for (int i=1; (ok) && (i < tenants_num); i++)
+	ok=handover_send(hs, tenants[i].tap_fd, 0, 0);
+    
+    // Connections (parked ones have no socket)
+    for (int i=0; (ok) && (i < conns_num); i++)
+	ok=give_conn(hs, conns[i], conns[i]->sock);
+    for (Conn *c=parked_conn; (ok) && (c); c=c->next)
+	ok=give_conn(hs, c, -1);
+    
+    // New process confirms it has taken everything
+    uint8_t ack;
+    if ( (ok) && (read(hs, &ack, 1) == 1) )
+    {
+	DEBUG("Handed over to new process\n");
+	exit(0);
+    }
+    
+    DEBUG("Handover failed\n");
+    close(hs);
+}
+
+
+// Taking sockets & connections from running server
+static bool take_over(int hs, int *SrvSock)
+{
+    int fd;
+    uint32_t len;
+    uint8_t *data=handover_recv(hs, &fd, &len);
+    if (! data) return false;
+    
+    uint32_t version, active, parked, tenant_nets;
+    struct handover_io s;
+    memset(&s, 0, sizeof(s));
+    s.in=data;
+    s.len=len;
+    s.ok=true;
+    s.io(&version, sizeof(version));
+    s.io(&server_id, sizeof(server_id));
+    s.io(&active, sizeof(active));
+    s.io(&parked, sizeof(parked));
+    s.io(&tenant_nets, sizeof(tenant_nets));
+    
+    // Connections know tenants by their order, so every one must have the same key
+    bool same=(tenant_nets == (uint32_t)tenants_num);
+    for (int i=0; (same) && (i < tenants_num); i++)
+    {
+	uint8_t print[16], mine[16];
+	s.io(print, 16);
+	key_print(i, mine);
+	same=(memcmp(print, mine, 16) == 0);
+    }
+    delete[] data;
+    
+    if ( (! s.ok) || (version != HANDOVER_VERSION) || (fd < 0) )
+    {
+	fprintf(stderr, "Error: running server can't hand over to this version\n");
+	if (fd >= 0) close(fd);
+	return false;
+    }
+    
+    if (! same)
+    {
+	fprintf(stderr, "Error: running server has other tenants\n");
+	close(fd);
+	return false;
+    }
+    (*SrvSock)=fd;
+    
+    // TAPs
+    data=handover_recv(hs, &tap_fd, &len);
+    if (! data) return false;
+    delete[] data;
+    for (int i=1; i<tenants_num; i++)
+    {
+	data=handover_recv(hs, &tenants[i].tap_fd, &len);
+	if (! data) return false;
+	delete[] data;
+    }
+    
+    // Connections (keeping their order)
+    Conn* *tail=&parked_conn;
+    for (uint32_t i=0; i<active+parked; i++)
+    {
+	data=handover_recv(hs, &fd, &len);
+	if (! data) return false;
 	
-	// Adding TAP header
-	buf[0]=0;
-	buf[1]=0;
-	buf[2]=data[12];    // protocol type
-	buf[3]=data[13];
-	memcpy(buf+4, data, len);
+	Conn *c=Conn::load(fd, route, data, len);
+	delete[] data;
+	if (! c)
+	{
+	    // Client will reconnect
+	    if (fd >= 0) close(fd);
+	    continue;
+	}
+	c->ctl=control;
 	
-	// Sending
-	if (write(tap_fd, buf, len+4) != len+4)
+	// Server which isn't ours any more is closed (it'd be unlimited)
+	if ( (c->peer) && (! peer_known(c)) )
 	{
-    	    DEBUG("TAP write failed (errno=%d)\n", errno);
+	    delete c;
+	    continue;
+	}
+	
+	// Links to other servers
+	for (int j=0; j<peer_links; j++)
+	    if ( (c->outgoing) && (! c->st->fin) &&
+		 (c->addr == peer_link[j].addr.sin_addr.s_addr) &&
+		 (c->port == peer_link[j].addr.sin_port) )
+		peer_link[j].conn=c;
+	
+	if (i < active)
+	{
+	    if (! conntab_add(c))
+	    {
+		delete c;
+		return false;
+	    }
+	} else
+	{
+	    (*tail)=c;
+	    tail=&c->next;
 	}
     }
     
+    // Everything is taken - old process can exit
+    uint8_t ack=1;
+    if (send(hs, &ack, 1, MSG_NOSIGNAL) != 1) return false;
+    close(hs);
+    
+    DEBUG("Taken over %u connections & %u sessions\n", active, parked);
     return true;
 }
 
 
-int start_server(const char *dev, int port)
+int start_server(const char *dev, const char *bridge, int port)
 {
     struct sockaddr_in SrvSockAddr;
-    int SrvSock;
+    int SrvSock=-1;
+    
+    if (! conntab_init(tenants_num-1)) return 0;
+    
+    // Allowing as many connections as system lets (poll has no FD_SETSIZE limit)
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+	rl.rlim_cur=rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    
+    // Taking everything from running server (if there is one)
+    if (handover_path)
+    {
+	int hs=handover_connect(handover_path);
+	if ( (hs >= 0) && (! take_over(hs, &SrvSock)) )
+	{
+	    fprintf(stderr, "Error: handover failed\n");
+	    return 0;
+	}
+    }
     
     // Opening TAP device
+    if (tap_fd >= 0)
+    {
+	dev=tap_name();
+	if (! dev) return -1;
+    } else
     if (dev)
     {
 	dev=tap_open(dev);
 	if (! dev) return -1;
     }
     
-    // Creating server socket
-    memset(&SrvSockAddr, 0x00, sizeof(SrvSockAddr));
-    SrvSockAddr.sin_family=AF_INET;
-    SrvSockAddr.sin_port=htons(port);
-    SrvSockAddr.sin_addr.s_addr=INADDR_ANY;
-    if ( (SrvSock=socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+    // Attaching to bridged interface
+    if (bridge)
     {
-	perror("socket");
-	return 0;
+	dev=bridge_open(bridge);
+	if (! dev) return -1;
     }
-    fcntl(SrvSock, F_SETFL, O_NONBLOCK);
-    int yes=1;
-    setsockopt(SrvSock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-    if ( (bind(SrvSock,(struct sockaddr*)(&SrvSockAddr),sizeof(SrvSockAddr)))!=0 )
+    mss_netif(dev);
+    if (dev) dev=strdup(dev);	// TAPs of tenants reuse name buffer
+    tenants[0].tap_fd=tap_fd;
+    
+    // TAPs of tenants (names are printed after default one)
+    for (int i=1; i<tenants_num; i++)
     {
-	perror("bind");
-	close(SrvSock);
-	return 0;
+	struct tenant *t=&tenants[i];
+	if (t->tap_fd >= 0)
+	    t->dev=tap_name(t->tap_fd); else
+	if (t->dev)
+	    t->dev=tap_open(t->dev, &t->tap_fd); else
+	    continue;
+	if (! t->dev) return -1;
+	t->dev=strdup(t->dev);
     }
-    if ( (listen(SrvSock, 10))!=0 )
+    
+    // Creating server socket (if it's not taken from old process)
+    if (SrvSock < 0)
     {
-	perror("listen");
-	close(SrvSock);
-	return 0;
+	memset(&SrvSockAddr, 0x00, sizeof(SrvSockAddr));
+	SrvSockAddr.sin_family=AF_INET;
+	SrvSockAddr.sin_port=htons(port);
+	SrvSockAddr.sin_addr.s_addr=INADDR_ANY;
+	if ( (SrvSock=socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+	{
+	    perror("socket");
+	    return 0;
+	}
+	fcntl(SrvSock, F_SETFL, O_NONBLOCK);
+	int yes=1;
+	setsockopt(SrvSock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if ( (bind(SrvSock,(struct sockaddr*)(&SrvSockAddr),sizeof(SrvSockAddr)))!=0 )
+	{
+	    perror("bind");
+	    close(SrvSock);
+	    return 0;
+	}
+	if ( (listen(SrvSock, LISTEN_BACKLOG))!=0 )
+	{
+	    perror("listen");
+	    close(SrvSock);
+	    return 0;
+	}
     }
     
+    // Waiting for next process to hand everything over to it
+    int hl=-1;
+    if ( (handover_path) && ((hl=handover_listen(handover_path)) < 0) ) return 0;
     
-    // Printing TAP name
+    
+    // Printing TAP names
     if (dev) printf("%s\n", dev);
+    for (int i=1; i<tenants_num; i++)
+	if (tenants[i].dev) printf("%s\n", tenants[i].dev);
     
     
 #ifndef EBUG
@@ -148,145 +962,172 @@ int start_server(const char *dev, int port)
     signal(SIGCHLD, SIG_IGN);
 #endif
     
+    // Making our id in mesh (old process gives its one)
+    if (! server_id)
+    {
+	uint8_t r[16];
+	rand128(r);
+	memcpy(&server_id, r, 8);
+    }
+    
+    // Service sockets in poll list
+    conn_pfd[PFD_SRV].fd=SrvSock;	// for new connections
+    conn_pfd[PFD_HANDOVER].fd=hl;	// for new process
+    conn_pfd[PFD_TAP].fd=tap_fd;	// local netif is always read (congested clients drop its frames)
+    conn_pfd[PFD_BRIDGE].fd=bridge_fd;
+    for (int i=1; i<tenants_num; i++)
+	conn_pfd[PFD_TENANT+i-1].fd=tenants[i].tap_fd;
+    
     // Main work cycle
+    time_t tick_t=0;
+    int events=0;
     while (1)
     {
-	fd_set fds_read;
-	fd_set fds_write;
-	fd_set fds_except;
-	struct timeval tv;
-	int max_fd;
-	
-	// Waiting 1sec for incoming events
-	tv.tv_sec=1;
-	tv.tv_usec=0;
-	
-	// Creating lists
-	FD_ZERO(&fds_read);
-	FD_ZERO(&fds_write);
-	FD_ZERO(&fds_except);
-	FD_SET(SrvSock,&fds_read);	// for new connections
-	max_fd=SrvSock;
-	{
-	    Conn *ent=tcp_conn;
-	    
-	    while (ent)
-	    {
-		int sock=ent->sock;
-		if (sock > max_fd) max_fd=sock;
-		
-		// Read list
-		if (ent->needRead())
-		    FD_SET(sock, &fds_read);
-		
-		// Write list
-		if (ent->needWrite())
-		    FD_SET(sock, &fds_write);
-		
-		// Exception list
-		FD_SET(sock, &fds_except);
-		
-		// Next
-		ent=ent->next;
-	    }
-	}
-	if (tap_fd >= 0)
-	{
-	    FD_SET(tap_fd, &fds_read);
-	    if (tap_fd > max_fd) max_fd=tap_fd;
-	}
+	// Links to other servers
+	connect_peers();
+	
+	// Accepting only when handshakes in progress can take more (kernel queues them meanwhile)
+	conn_pfd[PFD_SRV].fd=(Conn::handshakes_num < HANDSHAKES_MAX) ? SrvSock : -1;
 	
+	// Resuming connections which have got tokens again
+	for (int i=0; (Conn::throttled_num > 0) && (i < conns_num); i++)
+	    if (conn_st[i].throttled) conns[i]->unthrottle();
 	
-	// Waiting for events
-	if (select(max_fd+1, &fds_read, &fds_write, &fds_except, &tv)<0)
+	
+	// Waiting 1sec for events (or spinning in low-latency mode, or refilling rate limits)
+	int timeout=latency_timeout(events);
+	if ( (Conn::throttled_num > 0) && (timeout > THROTTLE_TICK) ) timeout=THROTTLE_TICK;
+	events=poll(conn_pfd, PFD_CONN+conns_num, timeout);
+	if (events < 0)
 	{
-	    // select failed - skipping it
+	    // poll failed - skipping it
 	    continue;
 	}
 	
 	
-	// Checking for server events
-	if (FD_ISSET(SrvSock,&fds_read))
+	// New process is taking over
+	if (conn_pfd[PFD_HANDOVER].revents & POLLIN) give_away(hl, SrvSock);
+	
+	// Checking for connection's events (idle connections aren't touched)
+	for (int i=0; i<conns_num; )
 	{
-	    // Got new connection
-	    socklen_t z=sizeof(struct sockaddr_in);
-	    struct sockaddr_in *addr;
-	    int sock=accept(SrvSock,(struct sockaddr*)(&addr),&z);
+	    struct pollfd *p=&conn_pfd[PFD_CONN+i];
+	    if (! p->revents)
+	    {
+		i++;
+		continue;
+	    }
+	    
+	    Conn *c=conns[i];
+	    short ev=p->revents;
+	    p->revents=0;
+	    
+	    // Checking for read (or error/close, which read tells about)
+	    if (ev & (POLLIN | POLLHUP | POLLERR)) c->doRead();
 	    
-	    if (sock>=0)
+	    // Checking for write
+	    if ( (ev & POLLOUT) && (! c->st->fin) ) c->doWrite();
+	    
+	    if (c->needClose())
 	    {
-		// Connection ok - putting it to the list
+		// Closing connection & keeping its session for a while
+		conntab_del(i);	// last connection takes this place (and it's checked next)
+		park(c);
+		continue;
+	    }
+	    
+	    i++;
+	}
+	
+	
+	// Checking for server events (after established connections, they go first)
+	if (conn_pfd[PFD_SRV].revents & POLLIN)
+	{
+	    // Got new connections (up to budget, the rest wait for next wakeup)
+	    for (int n=0; (n < ACCEPT_BUDGET) && (Conn::handshakes_num < HANDSHAKES_MAX); n++)
+	    {
+		int sock=accept4(SrvSock, 0, 0, SOCK_NONBLOCK);
+		if (sock < 0) break;
+		
+		// Connection ok - putting it to the table (tenant is found by its key)
 		Conn *ent=new Conn(sock, route);
-		if (ent)
+		if ( (ent) && (tenants_num > 1) ) ent->tenant=TENANT_UNKNOWN;
+		if ( (ent) && (conntab_add(ent)) )
 		{
-		    // Class ok
-		    ent->next=tcp_conn;
-		    tcp_conn=ent;
-		    
-		    // Setting socket to non-blocking mode
-		    fcntl(sock, F_SETFL, O_NONBLOCK);
+		    // Class ok (silent peer doesn't hold handshake slot for long)
+		    ent->ctl=control;
+		    ent->st->timeout_t=time(NULL) + HANDSHAKE_TIME;
 		} else
 		{
 		    // Allocation failed
-		    close(sock);
+		    if (ent) delete ent; else
+			close(sock);
+		    break;
 		}
 	    }
-	} //FD_ISSET(SrvSock, &fds_read)
+	} //POLLIN on SrvSock
 	
 	
-	// Checking for connection's events
+	// Once a second: keepalives & timeouts of all connections
+	time_t now=time(NULL);
+	if (now != tick_t)
 	{
-	    Conn* *ent=&tcp_conn;
-	    
-	    while (*ent)
+	    tick_t=now;
+	    shortcut_tick();
+	    cycles_check();
+	    for (int i=conns_num-1; i>=0; i--)
 	    {
-		int sock=(*ent)->sock;
+		// Connections which have nothing due aren't touched
+		const struct conn_state *st=&conn_st[i];
+		if ( (! st->fin) && (now <= st->timeout_t) && (now < st->ping_t) &&
+		     ( (st->outq_size > 0) || (now <= st->keepalive_t) ) ) continue;
 		
-		// Checking for read
-		if (FD_ISSET(sock, &fds_read))
+		Conn *c=conns[i];
+		c->needWrite();	// sends keepalive if it's time
+		if (c->needClose())
 		{
-		    (*ent)->doRead();
+		    conntab_del(i);
+		    park(c);
 		}
-		
-		// Checking for write
-		if (FD_ISSET(sock, &fds_write))
-		{
-		    (*ent)->doWrite();
-		}
-		
-		// Checking for error or close
-		if ( (FD_ISSET(sock, &fds_except)) ||
-		     ((*ent)->needClose()) )
+	    }
+	}
+	
+	
+	// Forgetting expired sessions
+	{
+	    Conn* *ent=&parked_conn;
+	    
+	    while (*ent)
+	    {
+		if ((*ent)->st->timeout_t < now)
 		{
-		    // Closing connection & deleting Conn
 		    Conn *tmp=(*ent);
 		    (*ent)=(*ent)->next;
 		    
-		    delete tmp;
+		    forget(tmp);
 		    
 		    continue;
 		}
 		
-		// Next
 		ent=&( (*ent)->next );
 	    }
 	}
 	
 	
 	// Checking for TAP events
-	if ( (tap_fd>=0) && (FD_ISSET(tap_fd, &fds_read)) )
+	if (conn_pfd[PFD_TAP].revents & POLLIN) tap_events(DEFAULT_NET);
+	for (int i=1; i<tenants_num; i++)
+	    if (conn_pfd[PFD_TENANT+i-1].revents & POLLIN) tap_events(&tenants[i]);
+	
+	
+	// Checking for bridged interface events
+	if (bridge_fd>=0)
 	{
-            // Packet from TAP
-            uint8_t buf[1600];
-            int len=read(tap_fd, buf, sizeof(buf));
-            if (len > (4+14))       // TAP header + Ethernet header
-            {
-                // Sending to peers
-                route(0, buf+4, len-4);   // removing TAP header
-            } else
-            {
-                DEBUG("Error reading from TAP (errno=%d)\n", errno);
-            }
+	    if (conn_pfd[PFD_BRIDGE].revents & POLLIN)
+		bridge_read(local_read);
+	    
+	    // Sending everything routed to it during this cycle
+	    bridge_flush();
 	}
     }
 }
@@ -5,7 +5,23 @@
 #include <stdint.h>
 
 
-int start_server(const char *dev, int port);
+class Conn;
+
+
+// How long closed sessions can be resumed (0 - disabled)
+extern int resume_grace;
+
+// UNIX socket for handing everything over to new process (0 - disabled)
+extern const char *handover_path;
+
+
+// Adding other server of mesh (HOST:PORT)
+bool server_add_peer(const char *host_port);
+
+int start_server(const char *dev, const char *bridge, int port);
+
+// Routing frame from src (0 - local netif) to connections in conntab (used by replay)
+bool server_route(Conn *src, const uint8_t *data, uint16_t len);
 
 
 #endif
@@ -0,0 +1,515 @@
+#include "shortcut.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "crypt.h"
+#include "debug.h"
+
+
+// Flows counted by server (pairs of clients)
+#define SC_FLOWS	1024
+#define SC_PROBE	4
+
+// Flow must be busy for so many seconds in a row
+#define SC_SUSTAIN	3
+
+// Links being brokered (pair isn't brokered again for SC_RETRY sec)
+#define SC_BROKERS	64
+#define SC_RETRY	60
+
+// MACs of other side given with link
+#define SC_MACS		16
+
+// Direct links of one client
+#define SC_MAX		8
+
+// Link must be made and authenticated in so many seconds
+#define SC_WAIT		10
+
+// Link without frames for so long is closed (its MACs may have moved)
+#define SC_IDLE		60
+
+
+int shortcut_pps=0;
+
+
+// Unicast between two clients (a < b) in current second
+struct flow
+{
+    Conn *a, *b;
+    uint32_t frames;
+    uint8_t secs;	// seconds over shortcut_pps
+};
+static struct flow flows[SC_FLOWS];
+
+// Link being made: listener reports its port, then connector is told where to connect
+struct broker
+{
+    uint64_t id;
+    uint8_t secret[16];
+    Conn *listener, *connector;
+    time_t retry_t;	// slot is free after that
+};
+static struct broker brokers[SC_BROKERS];
+
+
+// Direct link of client
+struct shortcut
+{
+    bool used;
+    bool listening;
+    bool authed;	// other side has shown it knows secret
+    int fd;		// listening or connecting socket (-1 - none)
+    Conn *conn;
+    uint64_t id;
+    uint8_t secret[16];
+    uint8_t macs[SC_MACS*6];	// hosts behind other side (more are learned from its frames)
+    uint16_t macs_num;
+    time_t deadline;	// link must be authenticated by then
+    time_t idle_t;	// closing link if no frames until then
+    uint32_t pkts;
+};
+static struct shortcut sc[SC_MAX];
+
+static pktHandler sc_handler=0;
+static int sc_keepalive=60;
+
+
+// MACs of client connection (up to SC_MACS)
+static uint16_t macs_of(Conn *c, uint8_t *out)
+{
+    uint16_t n=0;
+    if (! c->mac_table) return 0;
+    
+    for (uint16_t i=0; (i<c->mac_table_len) && (n<SC_MACS); i++)
+    {
+	if (c->mac_table[i].use == 0) continue;
+	memcpy(out+n*6, c->mac_table[i].mac, 6);
+	n++;
+    }
+    return n;
+}
+
+
+void shortcut_count(Conn *src, Conn *dst)
+{
+    Conn *a=(src < dst) ? src : dst;
+    Conn *b=(src < dst) ? dst : src;
+    
+    uint32_t h=(uint32_t)(((uintptr_t)a >> 4) ^ ((uintptr_t)b >> 2)) * 2654435761u;
+    for (int i=0; i<SC_PROBE; i++)
+    {
+	struct flow *f=&flows[(h+i) % SC_FLOWS];
+	if ( (f->a == a) && (f->b == b) )
+	{
+	    f->frames++;
+	    return;
+	}
+	if (! f->a)
+	{
+	    f->a=a;
+	    f->b=b;
+	    f->frames=1;
+	    f->secs=0;
+	    return;
+	}
+    }
+}
+
+
+static void make_link(Conn *a, Conn *b, time_t now)
+{
+    // Not trying pair again while it's being made (or has failed lately)
+    struct broker *k=0;
+    for (int i=0; i<SC_BROKERS; i++)
+    {
+	struct broker *o=&brokers[i];
+	if (o->retry_t <= now)
+	{
+	    if (! k) k=o;
+	    continue;
+	}
+	if ( ((o->listener == a) && (o->connector == b)) || ((o->listener == b) && (o->connector == a)) ) return;
+    }
+    if (! k) return;
+    
+    uint8_t r[16];
+    rand128(r);
+    memcpy(&k->id, r, 8);
+    rand128(k->secret);
+    k->listener=a;
+    k->connector=b;
+    k->retry_t=now + SC_RETRY;
+    
+    // Asking one side to listen
+    uint8_t msg[24+SC_MACS*6];
+    memcpy(msg, &k->id, 8);
+    memcpy(msg+8, k->secret, 16);
+    uint16_t n=macs_of(b, msg+24);
+    DEBUG("Shortcut: brokering link %016llx\n", (unsigned long long)k->id);
+    a->sendCtl(CTL_SC_LISTEN, msg, 24+n*6);
+}
+
+
+void shortcut_tick()
+{
+    if (shortcut_pps <= 0) return;
+    
+    time_t now=time(NULL);
+    for (int i=0; i<SC_FLOWS; i++)
+    {
+	struct flow *f=&flows[i];
+	if (! f->a) continue;
+	
+	// Slow flow is forgotten, busy one gets its link
+	if (f->frames < (uint32_t)shortcut_pps)
+	    f->a=f->b=0; else
+	if (++f->secs >= SC_SUSTAIN)
+	{
+	    make_link(f->a, f->b, now);
+	    f->a=f->b=0;
+	}
+	f->frames=0;
+    }
+}
+
+
+void shortcut_forget(Conn *c)
+{
+    if (shortcut_pps <= 0) return;
+    
+    for (int i=0; i<SC_FLOWS; i++)
+	if ( (flows[i].a == c) || (flows[i].b == c) ) flows[i].a=flows[i].b=0;
+    
+    for (int i=0; i<SC_BROKERS; i++)
+    {
+	if (brokers[i].listener == c) brokers[i].listener=0;
+	if (brokers[i].connector == c) brokers[i].connector=0;
+    }
+}
+
+
+bool shortcut_server_ctl(Conn *src, uint8_t type, const uint8_t *data, uint16_t len)
+{
+    switch (type)
+    {
+	case CTL_SHORTCUT:
+	    if (! src->peer) src->shortcuts=true;
+	    return true;
+	
+	case CTL_SC_PORT:
+	    if (len != 14) return false;
+	    for (int i=0; i<SC_BROKERS; i++)
+	    {
+		struct broker *k=&brokers[i];
+		if ( (k->listener != src) || (! k->connector) || (memcmp(&k->id, data, 8) != 0) ) continue;
+		
+		// Clients behind one NAT reach each other by local address, others by the one we see
+		uint32_t addr;
+		memcpy(&addr, data+8, 4);
+		if (k->connector->addr != src->addr) addr=src->addr;
+		
+		// Telling other side where to connect
+		uint8_t msg[30+SC_MACS*6];
+		memcpy(msg, &k->id, 8);
+		memcpy(msg+8, k->secret, 16);
+		memcpy(msg+24, &addr, 4);
+		memcpy(msg+28, data+12, 2);
+		uint16_t n=macs_of(src, msg+30);
+		k->connector->sendCtl(CTL_SC_CONNECT, msg, 30+n*6);
+		break;
+	    }
+	    return true;
+    }
+    
+    return true;
+}
+
+
+static struct shortcut* sc_of(Conn *c)
+{
+    for (int i=0; i<SC_MAX; i++)
+	if ( (sc[i].used) && (sc[i].conn == c) ) return &sc[i];
+    return 0;
+}
+
+
+static void sc_free(struct shortcut *s)
+{
+    if (s->fd >= 0) close(s->fd);
+    if (s->conn) delete s->conn;
+    s->fd=-1;
+    s->conn=0;
+    s->authed=false;
+    s->used=false;
+}
+
+
+// Frames of direct link are taken only after other side has authenticated
+static bool sc_data(Conn *src, const uint8_t *data, uint16_t len)
+{
+    struct shortcut *s=sc_of(src);
+    if ( (! s) || (! s->authed) ) return false;
+    
+    return sc_handler(src, data, len);
+}
+
+
+static bool sc_control(Conn *src, uint8_t type, const uint8_t *data, uint16_t len)
+{
+    struct shortcut *s=sc_of(src);
+    if (! s) return false;
+    
+    switch (type)
+    {
+	case CTL_READY:
+	    {
+		// Proving we're the side server has told about
+		uint8_t msg[24];
+		memcpy(msg, &s->id, 8);
+		memcpy(msg+8, s->secret, 16);
+		return src->sendCtl(CTL_SC_AUTH, msg, 24);
+	    }
+	
+	case CTL_SC_AUTH:
+	    if ( (len != 24) || (memcmp(data, &s->id, 8) != 0) || (memcmp(data+8, s->secret, 16) != 0) ) return false;
+	    
+	    DEBUG("Shortcut: link %016llx is up\n", (unsigned long long)s->id);
+	    s->authed=true;
+	    for (uint16_t i=0; i<s->macs_num; i++)
+		src->addMAC(s->macs+i*6);
+	    return true;
+    }
+    
+    return true;
+}
+
+
+// Slot for new link (0 if client has too many)
+static struct shortcut* sc_new(const uint8_t *id, const uint8_t *macs, uint16_t n)
+{
+    for (int i=0; i<SC_MAX; i++)
+    {
+	struct shortcut *s=&sc[i];
+	if (s->used) continue;
+	
+	memset(s, 0, sizeof(*s));
+	s->used=true;
+	s->fd=-1;
+	memcpy(&s->id, id, 8);
+	memcpy(s->secret, id+8, 16);
+	s->macs_num=(n < SC_MACS) ? n : SC_MACS;
+	memcpy(s->macs, macs, s->macs_num*6);
+	s->deadline=time(NULL) + SC_WAIT;
+	return s;
+    }
+    
+    return 0;
+}
+
+
+static void sc_open(struct shortcut *s, int sock)
+{
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    s->conn=new Conn(sock, sc_data, sc_keepalive);
+    s->conn->ext=true;	// server links only new clients
+    s->conn->ctl=sc_control;
+    s->idle_t=time(NULL) + SC_IDLE;
+}
+
+
+void shortcut_init(pktHandler handler, int keepalive)
+{
+    sc_handler=handler;
+    sc_keepalive=keepalive;
+}
+
+
+bool shortcut_client_ctl(Conn *server, uint8_t type, const uint8_t *data, uint16_t len)
+{
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family=AF_INET;
+    
+    switch (type)
+    {
+	case CTL_SC_LISTEN:
+	    {
+		if ( (len < 24) || ((len-24) % 6) ) return false;
+		struct shortcut *s=sc_new(data, data+24, (len-24)/6);
+		if (! s) return true;
+		
+		// Listening on any port of our address server connection goes from
+		struct sockaddr_in local;
+		socklen_t l=sizeof(sa), ll=sizeof(local);
+		s->fd=socket(AF_INET, SOCK_STREAM, 0);
+		s->listening=true;
+		if ( (s->fd < 0) ||
+		     (bind(s->fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) ||
+		     (listen(s->fd, 1) != 0) ||
+		     (getsockname(s->fd, (struct sockaddr*)&sa, &l) != 0) ||
+		     (getsockname(server->sock, (struct sockaddr*)&local, &ll) != 0) )
+		{
+		    DEBUG("Shortcut: can't listen (errno=%d)\n", errno);
+		    sc_free(s);
+		    return true;
+		}
+		fcntl(s->fd, F_SETFL, O_NONBLOCK);
+		
+		uint8_t msg[14];
+		memcpy(msg, &s->id, 8);
+		memcpy(msg+8, &local.sin_addr.s_addr, 4);
+		memcpy(msg+12, &sa.sin_port, 2);
+		server->sendCtl(CTL_SC_PORT, msg, 14);
+	    }
+	    return true;
+	
+	case CTL_SC_CONNECT:
+	    {
+		if ( (len < 30) || ((len-30) % 6) ) return false;
+		struct shortcut *s=sc_new(data, data+30, (len-30)/6);
+		if (! s) return true;
+		
+		memcpy(&sa.sin_addr.s_addr, data+24, 4);
+		memcpy(&sa.sin_port, data+28, 2);
+		s->fd=socket(AF_INET, SOCK_STREAM, 0);
+		if ( (s->fd < 0) ||
+		     (fcntl(s->fd, F_SETFL, O_NONBLOCK) != 0) ||
+		     ( (connect(s->fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) && (errno != EINPROGRESS) ) )
+		{
+		    DEBUG("Shortcut: can't connect (errno=%d)\n", errno);
+		    sc_free(s);
+		}
+	    }
+	    return true;
+    }
+    
+    return true;
+}
+
+
+Conn* shortcut_find(const uint8_t *dst)
+{
+    for (int i=0; i<SC_MAX; i++)
+    {
+	struct shortcut *s=&sc[i];
+	if ( (s->authed) && (! s->conn->st->fin) && (s->conn->findMAC(dst)) ) return s->conn;
+    }
+    
+    return 0;
+}
+
+
+int shortcut_fds(fd_set *rd, fd_set *wr, fd_set *ex)
+{
+    int max_fd=-1;
+    for (int i=0; i<SC_MAX; i++)
+    {
+	struct shortcut *s=&sc[i];
+	int fd=-1;
+	if (! s->used) continue;
+	
+	if ( (s->conn) && (! s->conn->st->fin) )
+	{
+	    fd=s->conn->sock;
+	    if (s->conn->needRead()) FD_SET(fd, rd);
+	    if (s->conn->needWrite()) FD_SET(fd, wr);
+	    FD_SET(fd, ex);
+	} else
+	if (s->fd >= 0)
+	{
+	    // Waiting for other side to connect (or for our connect to finish)
+	    fd=s->fd;
+	    FD_SET(fd, (s->listening) ? rd : wr);
+	}
+	
+	if (fd > max_fd) max_fd=fd;
+    }
+    
+    return max_fd;
+}
+
+
+void shortcut_events(fd_set *rd, fd_set *wr, fd_set *ex)
+{
+    time_t now=time(NULL);
+    
+    for (int i=0; i<SC_MAX; i++)
+    {
+	struct shortcut *s=&sc[i];
+	if (! s->used) continue;
+	
+	if (s->conn)
+	{
+	    Conn *c=s->conn;
+	    bool closed=c->st->fin;
+	    if (! closed)
+	    {
+		if (FD_ISSET(c->sock, rd)) c->doRead();
+		if ( (FD_ISSET(c->sock, wr)) && (! c->st->fin) ) c->doWrite();
+		if (FD_ISSET(c->sock, ex)) closed=true;
+	    }
+	    
+	    uint32_t pkts=c->rx_pkts + c->tx_pkts;
+	    if (pkts != s->pkts)
+	    {
+		s->pkts=pkts;
+		s->idle_t=now + SC_IDLE;
+	    }
+	    
+	    // Frames go through server again
+	    if ( (closed) || (c->needClose()) || ( (! s->authed) && (now > s->deadline) ) || (now > s->idle_t) )
+	    {
+		DEBUG("Shortcut: link %016llx closed\n", (unsigned long long)s->id);
+		sc_free(s);
+	    }
+	    continue;
+	}
+	
+	if ( (s->listening) && (FD_ISSET(s->fd, rd)) )
+	{
+	    // Other side has connected (nobody else can be accepted)
+	    int sock=accept(s->fd, 0, 0);
+	    if (sock >= 0)
+	    {
+		close(s->fd);
+		s->fd=-1;
+		sc_open(s, sock);
+	    }
+	} else
+	if ( (! s->listening) && (FD_ISSET(s->fd, wr)) )
+	{
+	    int err=0;
+	    socklen_t l=sizeof(err);
+	    getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &l);
+	    if (err == 0)
+	    {
+		int sock=s->fd;
+		s->fd=-1;
+		sc_open(s, sock);
+	    } else
+	    {
+		DEBUG("Shortcut: can't connect (errno=%d)\n", err);
+		sc_free(s);
+		continue;
+	    }
+	}
+	
+	if ( (! s->conn) && (now > s->deadline) ) sc_free(s);
+    }
+}
+
+
+void shortcut_close()
+{
+    for (int i=0; i<SC_MAX; i++)
+	if (sc[i].used) sc_free(&sc[i]);
+}
@@ -0,0 +1,45 @@
+#ifndef SHORTCUT_H
+#define SHORTCUT_H
+
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include "conn.h"
+
+
+// Server: frames/s of unicast between two clients which makes it broker direct link (0 - off)
+extern int shortcut_pps;
+
+
+// Server: counting unicast frame routed from src to dst (both are clients)
+void shortcut_count(Conn *src, Conn *dst);
+
+// Server: brokering links for flows which have been busy for a while (once a second)
+void shortcut_tick();
+
+// Server: client connection is gone
+void shortcut_forget(Conn *c);
+
+// Server: control messages of clients
+bool shortcut_server_ctl(Conn *src, uint8_t type, const uint8_t *data, uint16_t len);
+
+
+// Client: direct links give frames to handler
+void shortcut_init(pktHandler handler, int keepalive);
+
+// Client: control messages of server
+bool shortcut_client_ctl(Conn *server, uint8_t type, const uint8_t *data, uint16_t len);
+
+// Client: direct link to host with dst MAC (0 - send it through server)
+Conn* shortcut_find(const uint8_t *dst);
+
+// Client: select() lists (returns max fd) and events
+int shortcut_fds(fd_set *rd, fd_set *wr, fd_set *ex);
+void shortcut_events(fd_set *rd, fd_set *wr, fd_set *ex);
+
+// Client: closing everything (server connection is lost)
+void shortcut_close();
+
+
+#endif
@@ -28,13 +28,13 @@
 int tap_fd=-1;
 
 
-const char* tap_open(const char *dev)
+const char* tap_open(const char *dev, int *fd)
 {
     // Default interface name
     if (! dev) dev="tap%d";
     
     // Opening tun/tap device
-    if ( (tap_fd=open("/dev/net/tun", O_RDWR)) < 0 )
+    if ( ((*fd)=open("/dev/net/tun", O_RDWR)) < 0 )
     {
 	// Failed
 	perror("/dev/net/tun");
@@ -46,17 +46,59 @@ const char* tap_open(const char *dev)
     memset(&ifr, 0, sizeof(ifr));
     ifr.ifr_flags = IFF_TAP;    // with Ethernet headers
     strncpy(ifr.ifr_name, dev, IFNAMSIZ);
-    if (ioctl(tap_fd, TUNSETIFF, (void*)&ifr) < 0)
+    if (ioctl(*fd, TUNSETIFF, (void*)&ifr) < 0)
     {
         fprintf(stderr, "Error: can't get TAP interface\n");
-        close(tap_fd);
+        close(*fd);
+        (*fd)=-1;
         return 0;
     }
     
     // Setting non-blocking mode
-    fcntl(tap_fd, F_SETFL, O_NONBLOCK);
+    fcntl(*fd, F_SETFL, O_NONBLOCK);
     
     
     // Returning TAP name
     return ifr.ifr_name;
 }
+
+
+const char* tap_name(int fd)
+{
+    static struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    if (ioctl(fd, TUNGETIFF, (void*)&ifr) < 0)
+    {
+	fprintf(stderr, "Error: can't get TAP interface\n");
+	return 0;
+    }
+    
+    return ifr.ifr_name;
+}
+
+
+bool tap_write(const uint8_t *data, uint16_t size, int fd)
+{
+    uint8_t buf[size+4];
+    memcpy(buf+4, data, size);
+    return tap_write_buf(buf, size, fd);
+}
+
+
+bool tap_write_buf(uint8_t *buf, uint16_t size, int fd)
+{
+    // Adding TAP header
+    buf[0]=0;
+    buf[1]=0;
+    buf[2]=buf[4+12];	// protocol type
+    buf[3]=buf[4+13];
+    
+    // Sending
+    if (write(fd, buf, size+4) != size+4)
+    {
+	DEBUG("TAP write failed (errno=%d)\n", errno);
+	return false;
+    }
+    
+    return true;
+}
@@ -2,10 +2,17 @@
 #define TAP_H
 
 
+#include <stdint.h>
+
+
 extern int tap_fd;
 
 
-const char* tap_open(const char *dev);
+// Functions work with tap_fd unless they are given other TAP (tenants of server have their own)
+const char* tap_open(const char *dev, int *fd=&tap_fd);
+const char* tap_name(int fd=tap_fd);	// name of interface (when it's taken from other process)
+bool tap_write(const uint8_t *data, uint16_t size, int fd=tap_fd);
+bool tap_write_buf(uint8_t *buf, uint16_t size, int fd=tap_fd);	// frame is at buf+4, header is written in place
 
 
 #endif
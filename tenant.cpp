@@ -0,0 +1,107 @@
+#include "tenant.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "conn.h"
+#include "crypt.h"
+#include "debug.h"
+
+
+// Tenants can't reach sentinels of Conn::tenant
+#define MAX_TENANTS	4096
+
+
+static struct tenant default_net={ {0}, 0, -1, 0, 0, 0 };
+
+struct tenant *tenants=&default_net;
+int tenants_num=1;
+
+static int tenants_max=1;
+
+
+bool tenant_add(char *arg)
+{
+    char *k=strchr(arg, ':');
+    if ( (! k) || (strlen(k+1) < 4) || (tenants_num >= MAX_TENANTS) )
+    {
+	fprintf(stderr, "Error: incorrect tenant (DEV:KEY, key is at least 4 characters)\n");
+	return false;
+    }
+    
+    if (tenants_num >= tenants_max)
+    {
+	int max=tenants_max*2;
+	struct tenant *t=new struct tenant[max];
+	memcpy(t, tenants, sizeof(struct tenant)*tenants_num);
+	if (tenants != &default_net) delete[] tenants;
+	tenants=t;
+	tenants_max=max;
+    }
+    
+    struct tenant *t=&tenants[tenants_num++];
+    memset(t, 0, sizeof(*t));
+    t->tap_fd=-1;
+    
+    (*k)=0;
+    if (*arg) t->dev=strdup(arg);
+    makeKey128(k+1, t->key);
+    
+    // Hiding password for ps/top/etc
+    for (char *s=k+1; *s; s++)
+	(*s)=0;
+    return true;
+}
+
+
+bool tenant_init()
+{
+    memcpy(tenants[0].key, key128, 16);
+    
+    // Tenant is found by key of client
+    for (int i=0; i<tenants_num; i++)
+	for (int j=i+1; j<tenants_num; j++)
+	    if (memcmp(tenants[i].key, tenants[j].key, 16) == 0)
+	    {
+		fprintf(stderr, "Error: tenants must have different keys\n");
+		return false;
+	    }
+    return true;
+}
+
+
+bool tenant_join(Conn *c)
+{
+    struct tenant *t=&tenants[c->tenant];
+    if (t->conns_num >= t->conns_max)
+    {
+	int max=(t->conns_max > 0) ? t->conns_max*2 : 16;
+	Conn **n=new Conn*[max];
+	if (! n) return false;
+	if (t->conns)
+	{
+	    memcpy(n, t->conns, sizeof(Conn*)*t->conns_num);
+	    delete[] t->conns;
+	}
+	t->conns=n;
+	t->conns_max=max;
+    }
+    
+    t->conns[t->conns_num++]=c;
+    return true;
+}
+
+
+void tenant_leave(Conn *c)
+{
+    if (c->tenant >= tenants_num) return;	// it hasn't joined
+    
+    // Last connection takes its place
+    struct tenant *t=&tenants[c->tenant];
+    for (int i=0; i<t->conns_num; i++)
+	if (t->conns[i] == c)
+	{
+	    t->conns[i]=t->conns[--t->conns_num];
+	    return;
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef TENANT_H
+#define TENANT_H
+
+
+#include <stdint.h>
+
+
+class Conn;
+
+
+// Tenant of server connection which hasn't shown its key yet
+#define TENANT_UNKNOWN	0xffff	// waiting for seed
+#define TENANT_PROBING	0xfffe	// first frame is tried with key of every tenant
+
+
+// Isolated network of server: its own key, connections (with their MAC tables) and TAP.
+// Tenant 0 is the network of --key (--dev, --bridge and mesh belong to it).
+struct tenant
+{
+    uint8_t key[16];
+    const char *dev;	// TAP name (0 - none)
+    int tap_fd;
+    
+    // Connections routed between (scans never leave the tenant)
+    Conn **conns;
+    int conns_num, conns_max;
+};
+
+extern struct tenant *tenants;
+extern int tenants_num;	// 1 - server has only default network
+
+
+// Adding tenant from [DEV]:KEY (key is wiped from argument)
+bool tenant_add(char *arg);
+
+// Default network gets key of --key (all keys must differ)
+bool tenant_init();
+
+// Connection with known tenant comes to server's table and leaves it
+bool tenant_join(Conn *c);
+void tenant_leave(Conn *c);
+
+
+#endif
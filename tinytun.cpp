@@ -5,10 +5,44 @@
 #include <string.h>
 #include <time.h>
 #include <getopt.h>
+#include <sched.h>
 
 #include "crypt.h"
 #include "server.h"
 #include "client.h"
+#include "capture.h"
+#include "neigh.h"
+#include "mcast.h"
+#include "latency.h"
+#include "prio.h"
+#include "bucket.h"
+#include "mss.h"
+#include "replay.h"
+#include "shortcut.h"
+#include "cycles.h"
+#include "tenant.h"
+#include "acl.h"
+#include "conn.h"
+
+
+// Long-only options
+enum
+{
+    OPT_MCAST_UNKNOWN=256,
+    OPT_PCAP_SIZE,
+    OPT_PCAP_SNAPLEN,
+    OPT_PCAP_MAC,
+    OPT_PCAP_PEER,
+    OPT_SPIN,
+    OPT_DSCP_MAP,
+    OPT_RATE_IN,
+    OPT_RATE_OUT,
+    OPT_MSS,
+    OPT_REPLAY,
+    OPT_SHORTCUT,
+    OPT_CYCLES,
+    OPT_ACL,
+};
 
 
 void usage(void)
@@ -17,10 +51,38 @@ void usage(void)
     fprintf(stderr, "  -k / --key KEY           Specify connection key (4..16 chars)\n");
     fprintf(stderr, "  -s / --server PORT       Run as server and listen on specified port\n");
     fprintf(stderr, "  -c / --client HOST:PORT  Run as client and connect to specified HOST:PORT\n");
+    fprintf(stderr, "                               (or to one of HOST:PORT,HOST:PORT,... servers of mesh)\n");
     fprintf(stderr, "  -t / --timeout t         Set keepalive timeout (5..60 sec, client only)\n");
     fprintf(stderr, "  -d / --dev DEV           Use specified networking interface name\n");
     fprintf(stderr, "                               client's default is tap%%d\n");
     fprintf(stderr, "                               server's default is none (just route packets without netif)\n");
+    fprintf(stderr, "  -b / --bridge IF         Bridge tunnel to existing interface IF (server only, instead of --dev)\n");
+    fprintf(stderr, "  -r / --resume t          Keep sessions of disconnected clients for t sec (0..3600, default 30, server only)\n");
+    fprintf(stderr, "  -a / --arp-proxy t       Answer ARP/ND requests for hosts seen in last t sec (0..3600, default 0 - off, server only)\n");
+    fprintf(stderr, "  -m / --mcast t           Send multicast only to clients which reported group in last t sec\n");
+    fprintf(stderr, "                               (IGMP/MLD snooping, 0..3600, default 0 - off, server only)\n");
+    fprintf(stderr, "       --mcast-unknown P   Policy for groups without members: flood (default) or drop\n");
+    fprintf(stderr, "  -H / --handover PATH     Take over from server running with same PATH, then wait for next one there\n");
+    fprintf(stderr, "                               (restart without dropping connections, server only)\n");
+    fprintf(stderr, "  -P / --peer HOST:PORT    Link to other server of mesh (can be repeated, server only)\n");
+    fprintf(stderr, "  -T / --tenant [DEV]:KEY  Serve isolated network of clients with KEY, with its own TAP DEV if given\n");
+    fprintf(stderr, "                               (can be repeated, server only)\n");
+    fprintf(stderr, "       --shortcut PPS      Link clients directly when one sends other over PPS frames/s for 3 sec (server only)\n");
+    fprintf(stderr, "       --mss N             Clamp MSS of forwarded TCP SYNs to N (IPv6 gets N-20) or to netif's MTU-40 (auto)\n");
+    fprintf(stderr, "       --rate-in B[,F]     Stop reading client sending over B bytes/s (k, m suffixes) or F frames/s (server only)\n");
+    fprintf(stderr, "       --rate-out B[,F]    Send to every client not more than B bytes/s or F frames/s (server only)\n");
+    fprintf(stderr, "       --acl FILE          Drop frames matching rules of FILE before they are routed or sent\n");
+    fprintf(stderr, "  -L / --low-latency CPU   Pin to CPU (-1 - don't pin), busy poll and keep send queues short\n");
+    fprintf(stderr, "       --spin US           Busy polling time after last event (0..100000, default 200)\n");
+    fprintf(stderr, "       --dscp-map MAP      Send queue bands of DSCP values: DSCP[-DSCP]:BAND,... (0 - high, 1 - normal, 2 - low)\n");
+    fprintf(stderr, "  -p / --pcap FILE         Preallocate pcapng capture ring in FILE (SIGUSR1 starts/stops capture)\n");
+    fprintf(stderr, "       --pcap-size KB      Capture ring size (default 4096)\n");
+    fprintf(stderr, "       --pcap-snaplen N    Capture only first N bytes of frames (14..1600, default 128)\n");
+    fprintf(stderr, "       --pcap-mac MAC      Capture only frames from/to MAC\n");
+    fprintf(stderr, "       --pcap-peer ADDR    Capture only frames of connection with peer IP[:PORT]\n");
+    fprintf(stderr, "       --cycles FILE       Write CPU cycles of data path stages to FILE on SIGUSR2 (build with -DCYCLES)\n");
+    fprintf(stderr, "       --replay FILE       Route frames of server's capture through mock connections and show costs\n");
+    fprintf(stderr, "                               (instead of --server, server's routing options apply)\n");
     exit(-1);
 }
 
@@ -31,7 +93,15 @@ int main(int argc, char **argv)
     char *client_host_port=0;
     const char *key_str=0;
     const char *dev=0;
+    const char *bridge=0;
     int keepalive=60;
+    const char *pcap_file=0;
+    int pcap_size=4096;
+    int pcap_snaplen=128;
+    bool peers=false;
+    const char *replay_file=0;
+    const char *cycles_file=0;
+    const char *acl_file=0;
     
     // Parsing command line options
     struct option opts[]=
@@ -41,10 +111,33 @@ int main(int argc, char **argv)
 	{ "key",	required_argument,	0,	'k' },
 	{ "dev",	required_argument,	0,	'd' },
 	{ "timeout",	required_argument,	0,	't' },
+	{ "bridge",	required_argument,	0,	'b' },
+	{ "resume",	required_argument,	0,	'r' },
+	{ "arp-proxy",	required_argument,	0,	'a' },
+	{ "mcast",	required_argument,	0,	'm' },
+	{ "mcast-unknown", required_argument,	0,	OPT_MCAST_UNKNOWN },
+	{ "handover",	required_argument,	0,	'H' },
+	{ "peer",	required_argument,	0,	'P' },
+	{ "tenant",	required_argument,	0,	'T' },
+	{ "shortcut",	required_argument,	0,	OPT_SHORTCUT },
+	{ "mss",	required_argument,	0,	OPT_MSS },
+	{ "rate-in",	required_argument,	0,	OPT_RATE_IN },
+	{ "rate-out",	required_argument,	0,	OPT_RATE_OUT },
+	{ "acl",	required_argument,	0,	OPT_ACL },
+	{ "low-latency", required_argument,	0,	'L' },
+	{ "spin",	required_argument,	0,	OPT_SPIN },
+	{ "dscp-map",	required_argument,	0,	OPT_DSCP_MAP },
+	{ "pcap",	required_argument,	0,	'p' },
+	{ "pcap-size",	required_argument,	0,	OPT_PCAP_SIZE },
+	{ "pcap-snaplen", required_argument,	0,	OPT_PCAP_SNAPLEN },
+	{ "pcap-mac",	required_argument,	0,	OPT_PCAP_MAC },
+	{ "pcap-peer",	required_argument,	0,	OPT_PCAP_PEER },
+	{ "cycles",	required_argument,	0,	OPT_CYCLES },
+	{ "replay",	required_argument,	0,	OPT_REPLAY },
 	{ 0 }
     };
     int opt;
-    while ( (opt=getopt_long(argc, argv, "s:c:k:d:t:", opts, 0)) > 0)
+    while ( (opt=getopt_long(argc, argv, "s:c:k:d:b:t:r:a:m:H:P:T:L:p:", opts, 0)) > 0)
     {
 	switch (opt)
 	{
@@ -76,6 +169,10 @@ int main(int argc, char **argv)
 		dev=optarg;
 		break;
 	    
+	    case 'b':
+		bridge=optarg;
+		break;
+	    
 	    case 't':
 		if ( (sscanf(optarg, "%d", &keepalive)!=1) ||
 		     (keepalive < 5) ||
@@ -85,6 +182,134 @@ int main(int argc, char **argv)
 		}
 		break;
 	    
+	    case 'r':
+		if ( (sscanf(optarg, "%d", &resume_grace)!=1) ||
+		     (resume_grace < 0) ||
+		     (resume_grace > 3600) )
+		{
+		    fprintf(stderr, "Error: incorrect resume time\n");
+		    return -1;
+		}
+		break;
+	    
+	    case 'a':
+		if ( (sscanf(optarg, "%d", &neigh_timeout)!=1) ||
+		     (neigh_timeout < 0) ||
+		     (neigh_timeout > 3600) )
+		{
+		    fprintf(stderr, "Error: incorrect ARP proxy time\n");
+		    return -1;
+		}
+		break;
+	    
+	    case 'm':
+		if ( (sscanf(optarg, "%d", &mcast_timeout)!=1) ||
+		     (mcast_timeout < 0) ||
+		     (mcast_timeout > 3600) )
+		{
+		    fprintf(stderr, "Error: incorrect multicast timeout\n");
+		    return -1;
+		}
+		break;
+	    
+	    case OPT_MCAST_UNKNOWN:
+		if (strcmp(optarg, "flood")==0)
+		    mcast_flood_unknown=true; else
+		if (strcmp(optarg, "drop")==0)
+		    mcast_flood_unknown=false; else
+		{
+		    fprintf(stderr, "Error: incorrect multicast policy\n");
+		    return -1;
+		}
+		break;
+	    
+	    case 'H':
+		handover_path=optarg;
+		break;
+	    
+	    case 'P':
+		if (! server_add_peer(optarg)) return -1;
+		peers=true;
+		break;
+	    
+	    case 'T':
+		if (! tenant_add(optarg)) return -1;
+		break;
+	    
+	    case OPT_SHORTCUT:
+		if ( (sscanf(optarg, "%d", &shortcut_pps)!=1) || (shortcut_pps < 0) )
+		{
+		    fprintf(stderr, "Error: incorrect shortcut rate\n");
+		    return -1;
+		}
+		break;
+	    
+	    case OPT_MSS:
+		if (! mss_parse(optarg)) return -1;
+		break;
+	    
+	    case OPT_RATE_IN:
+		if (! rate_parse(&rate_in, optarg)) return -1;
+		break;
+	    
+	    case OPT_RATE_OUT:
+		if (! rate_parse(&rate_out, optarg)) return -1;
+		break;
+	    
+	    case OPT_ACL:
+		acl_file=optarg;
+		break;
+	    
+	    case 'L':
+		latency_mode=true;
+		if ( (sscanf(optarg, "%d", &latency_cpu)!=1) || (latency_cpu < -1) || (latency_cpu >= CPU_SETSIZE) )
+		{
+		    fprintf(stderr, "Error: incorrect CPU\n");
+		    return -1;
+		}
+		Conn::queue_size=LATENCY_Q_SIZE;
+		break;
+	    
+	    case OPT_SPIN:
+		if ( (sscanf(optarg, "%d", &latency_spin)!=1) || (latency_spin < 0) || (latency_spin > 100000) )
+		{
+		    fprintf(stderr, "Error: incorrect spin time\n");
+		    return -1;
+		}
+		break;
+	    
+	    case OPT_DSCP_MAP:
+		if (! prio_map(optarg)) return -1;
+		break;
+	    
+	    case 'p':
+		pcap_file=optarg;
+		break;
+	    
+	    case OPT_PCAP_SIZE:
+		pcap_size=atoi(optarg);
+		break;
+	    
+	    case OPT_PCAP_SNAPLEN:
+		pcap_snaplen=atoi(optarg);
+		break;
+	    
+	    case OPT_PCAP_MAC:
+		if (! capture_filter_mac(optarg)) return -1;
+		break;
+	    
+	    case OPT_PCAP_PEER:
+		if (! capture_filter_peer(optarg)) return -1;
+		break;
+	    
+	    case OPT_CYCLES:
+		cycles_file=optarg;
+		break;
+	    
+	    case OPT_REPLAY:
+		replay_file=optarg;
+		break;
+	    
 	    case '?':
 	    default:
 		// Bad option
@@ -95,45 +320,88 @@ int main(int argc, char **argv)
     // Checking arguments
     if ( (optind < argc) ||
 	 (! key_str) ||
-	 ( (server_port==0) && (!client_host_port) ) ||
-	 ( (server_port>0) && (client_host_port) ) )
+	 ( (server_port==0) && (!client_host_port) && (!replay_file) ) ||
+	 ( (server_port>0) + (client_host_port!=0) + (replay_file!=0) > 1 ) ||
+	 ( (bridge) && ((dev) || (client_host_port)) ) ||
+	 ( ((peers) || (handover_path) || (tenants_num > 1)) && (client_host_port) ) )
 	usage();
     
     // Seeding random
-    srand(time(NULL));
+    srand(time(NULL) ^ getpid());	// nodes started at once must differ (seeds, sessions, server ids)
     
     // Making a key from password
     makeKey128(key_str);
+    if (! tenant_init()) return -1;
+    
+    // Compiling ACL (tables of tenants)
+    if ( (acl_file) && (! acl_load(acl_file)) ) return -1;
+    
+    // Replaying capture instead of serving
+    if (replay_file) return replay(replay_file) ? 0 : -1;
+    
+    // Preparing capture ring
+    if ( (pcap_file) && (! capture_open(pcap_file, pcap_size, pcap_snaplen)) ) return -1;
+    
+    // Preparing cycles report
+    if ( (cycles_file) && (! cycles_open(cycles_file)) ) return -1;
+    
+    // Pinning (inherited by daemon)
+    latency_setup();
     
     // Starting server
     if (server_port > 0)
     {
-	if (! start_server(dev, server_port)) return -1;
+	if (! start_server(dev, bridge, server_port)) return -1;
     }
     
     // Starting client
     if (client_host_port)
     {
-	const char *host=client_host_port;
-	int port=0;
+	char *hosts[MAX_SERVERS];
+	int ports[MAX_SERVERS];
+	int servers=0;
 	
-	char *sport=strchr(client_host_port, ':');
-	if ( (! *sport) || (sscanf(sport+1, "%d", &port)!=1) || (port < 1) || (port > 65535) )
+	char *host=strtok(client_host_port, ",");
+	while (host)
 	{
-	    fprintf(stderr, "Error: incorrect client port\n");
-	    return -1;
+	    int port=0;
+	    
+	    if (servers >= MAX_SERVERS)
+	    {
+		fprintf(stderr, "Error: too many servers\n");
+		return -1;
+	    }
+	    
+	    char *sport=strchr(host, ':');
+	    if ( (! sport) || (sscanf(sport+1, "%d", &port)!=1) || (port < 1) || (port > 65535) )
+	    {
+		fprintf(stderr, "Error: incorrect client port\n");
+		return -1;
+	    }
+	    
+	    (*sport)=0;	// ':' -> nul
+	    
+	    if (! *host)
+	    {
+		// No host
+		fprintf(stderr, "Error: no host specified\n");
+		return -1;
+	    }
+	    
+	    hosts[servers]=host;
+	    ports[servers]=port;
+	    servers++;
+	    
+	    host=strtok(0, ",");
 	}
 	
-	(*sport)=0;	// ':' -> nul
-	
-	if (! *host)
+	if (servers == 0)
 	{
-	    // No host
 	    fprintf(stderr, "Error: no host specified\n");
 	    return -1;
 	}
 	
-	if (! start_client(dev, host, port, keepalive)) return -1;
+	if (! start_client(dev, hosts, ports, servers, keepalive)) return -1;
     }
     
     // Everything is ok